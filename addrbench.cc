@@ -0,0 +1,470 @@
+#include <iostream>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include "comboaddress.hh"
+#include "netmasktree.hh"
+#include "netmaskgroup.hh"
+#include "intervalindex.hh"
+#include "dir248.hh"
+#include "heavyhitters.hh"
+#include "comboaddressfmt.hh"
+
+/** Benchmarks for the address datastructures. Run as 'addrbench [name...]', without
+    arguments all benchmarks are run. */
+
+static std::mt19937 g_rng(42);
+static volatile size_t g_sink; //!< results go here so the compiler can't optimize them away
+
+static ComboAddress randomIPv4()
+{
+  ComboAddress ret;
+  ret.sin4.sin_addr.s_addr = g_rng();
+  return ret;
+}
+
+static ComboAddress randomIPv6()
+{
+  ComboAddress ret;
+  memset(&ret.sin6, 0, sizeof(ret.sin6));
+  ret.sin6.sin6_family = AF_INET6;
+  uint32_t* p = (uint32_t*)&ret.sin6.sin6_addr.s6_addr;
+  p[0] = htonl(0x20010000 | (g_rng() & 0xffff)); // 2001::/16 like real life
+  for(int n = 1; n < 4; ++n)
+    p[n] = g_rng();
+  return ret;
+}
+
+//! a mix of mostly IPv4 and some IPv6 prefixes, of plausible lengths
+static std::vector<Netmask> randomNetmasks(unsigned int num)
+{
+  std::vector<Netmask> ret;
+  ret.reserve(num);
+  for(unsigned int n = 0; n < num; ++n) {
+    if(n % 4)
+      ret.push_back(Netmask(randomIPv4(), 8 + g_rng() % 25));
+    else
+      ret.push_back(Netmask(randomIPv6(), 16 + g_rng() % 113));
+  }
+  return ret;
+}
+
+static std::vector<ComboAddress> randomAddresses(unsigned int num)
+{
+  std::vector<ComboAddress> ret;
+  ret.reserve(num);
+  for(unsigned int n = 0; n < num; ++n)
+    ret.push_back(n % 4 ? randomIPv4() : randomIPv6());
+  return ret;
+}
+
+//! runs func, returns the number of nanoseconds it took
+static double timeIt(const std::function<void()>& func)
+{
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count();
+}
+
+static void benchNetmaskTree()
+{
+  for(unsigned int num : {1000, 100000, 1000000}) {
+    auto netmasks = randomNetmasks(num);
+    NetmaskTree<unsigned int> nmt;
+    double nsec = timeIt([&]() {
+        for(unsigned int n = 0; n < netmasks.size(); ++n)
+          nmt.insert(netmasks[n], n);
+      });
+    fmt::printf("%d prefixes: NetmaskTree insert %.1f ns/prefix\n", num, nsec/num);
+
+    auto addresses = randomAddresses(1000000);
+    unsigned int matches = 0;
+    nsec = timeIt([&]() {
+        for(const auto& ca : addresses)
+          if(nmt.lookup(ca))
+            ++matches;
+      });
+    fmt::printf("%d prefixes: NetmaskTree lookup %.1f ns/lookup, %d matches\n", num, nsec/addresses.size(), matches);
+
+    // keep the linear scan to roughly 10^8 Netmask::match calls
+    addresses.resize(std::max(10U, 100000000U / num));
+    matches = 0;
+    nsec = timeIt([&]() {
+        for(const auto& ca : addresses) {
+          const Netmask* best = nullptr;
+          for(const auto& nm : netmasks) { // longest match means we have to look at all of them
+            if(nm.match(ca) && (!best || nm.getBits() > best->getBits()))
+              best = &nm;
+          }
+          if(best)
+            ++matches;
+        }
+      });
+    fmt::printf("%d prefixes: linear Netmask::match %.1f ns/lookup\n", num, nsec/addresses.size());
+  }
+}
+
+static void benchNetmaskGroup()
+{
+  auto addresses = randomAddresses(1000000);
+  for(unsigned int num : {16, 256, 4096}) {
+    auto netmasks = randomNetmasks(num);
+    NetmaskGroup nmg;
+    for(const auto& nm : netmasks)
+      nmg.add(nm);
+
+    unsigned int matches = 0;
+    double nsec = timeIt([&]() {
+        for(const auto& ca : addresses) {
+          for(const auto& nm : netmasks) {
+            if(nm.match(ca)) {
+              ++matches;
+              break;
+            }
+          }
+        }
+      });
+    fmt::printf("%d netmasks: linear Netmask::match %.1f ns/address, %d matches\n", num, nsec/addresses.size(), matches);
+
+    matches = 0;
+    nsec = timeIt([&]() {
+        for(const auto& ca : addresses)
+          if(nmg.match(ca))
+            ++matches;
+      });
+    fmt::printf("%d netmasks: NetmaskGroup::match %.1f ns/address, %d matches\n", num, nsec/addresses.size(), matches);
+
+    matches = 0;
+    std::vector<bool> result;
+    const unsigned int batch = 64;
+    nsec = timeIt([&]() {
+        for(unsigned int n = 0; n + batch <= addresses.size(); n += batch) {
+          nmg.matchBatch(&addresses[n], batch, result);
+          matches += std::count(result.begin(), result.end(), true);
+        }
+      });
+    fmt::printf("%d netmasks: NetmaskGroup::matchBatch %.1f ns/address, %d matches\n", num, nsec/addresses.size(), matches);
+  }
+}
+
+template<typename Map>
+static void benchClientTable(const std::string& name, const std::vector<ComboAddress>& clients)
+{
+  Map table;
+  double nsec = timeIt([&]() {
+      for(const auto& ca : clients)
+        ++table[ca];
+    });
+  fmt::printf("%s: %.1f ns/insert, %d entries\n", name, nsec/clients.size(), table.size());
+
+  uint64_t found = 0;
+  nsec = timeIt([&]() {
+      for(const auto& ca : clients) {
+        auto iter = table.find(ca);
+        if(iter != table.end())
+          found += iter->second;
+      }
+    });
+  fmt::printf("%s: %.1f ns/lookup\n", name, nsec/clients.size());
+}
+
+static void benchHash()
+{
+  auto clients = randomAddresses(10000000);
+  for(auto& ca : clients)
+    ca.setPort(g_rng());
+
+  double nsec = timeIt([&]() {
+      size_t sum = 0;
+      for(const auto& ca : clients)
+        sum += std::hash<ComboAddress>()(ca);
+      g_sink = sum;
+    });
+  fmt::printf("std::hash<ComboAddress>: %.1f ns/hash\n", nsec/clients.size());
+  ComboAddress::seededHash sh;
+  nsec = timeIt([&]() {
+      size_t sum = 0;
+      for(const auto& ca : clients)
+        sum += sh(ca);
+      g_sink = sum;
+    });
+  fmt::printf("ComboAddress::seededHash: %.1f ns/hash\n", nsec/clients.size());
+
+  benchClientTable<std::unordered_map<ComboAddress, uint64_t>>("unordered_map", clients);
+  benchClientTable<std::unordered_map<ComboAddress, uint64_t, ComboAddress::seededHash>>("unordered_map seededHash", clients);
+  benchClientTable<std::map<ComboAddress, uint64_t>>("map", clients);
+}
+
+static void benchFormat()
+{
+  auto addresses = randomAddresses(1000000);
+  size_t total = 0;
+  double nsec = timeIt([&]() {
+      for(const auto& ca : addresses)
+        total += ca.toStringWithPort().size();
+    });
+  fmt::printf("toStringWithPort: %.1f ns/address\n", nsec/addresses.size());
+
+  nsec = timeIt([&]() {
+      char buf[ComboAddress::maxStringLength];
+      for(const auto& ca : addresses)
+        total += ca.toCharsWithPort(buf, sizeof(buf));
+    });
+  fmt::printf("toCharsWithPort: %.1f ns/address\n", nsec/addresses.size());
+
+  nsec = timeIt([&]() {
+      std::string buf; // reused, and accepted by format_to() in both the bundled fmt 5 and fmt 9+
+      for(const auto& ca : addresses) {
+        buf.clear();
+        fmt::format_to(std::back_inserter(buf), "{:p}", ca);
+        total += buf.size();
+      }
+    });
+  fmt::printf("fmt::format_to: %.1f ns/address\n", nsec/addresses.size());
+  g_sink = total;
+}
+
+static void benchParse()
+{
+  auto addresses = randomAddresses(1000000);
+  std::vector<std::string> strings;
+  for(auto& ca : addresses) {
+    ca.setPort(g_rng());
+    strings.push_back(g_rng() % 2 ? ca.toStringWithPort() : ca.toString());
+  }
+
+  unsigned int ok = 0;
+  double nsec = timeIt([&]() {
+      for(const auto& str : strings) { // how the constructor used to do it
+        ComboAddress ca;
+        memset(&ca.sin6, 0, sizeof(ca.sin6));
+        ca.sin4.sin_family = AF_INET;
+        if(!makeIPv4sockaddr(str, &ca.sin4))
+          ++ok;
+        else {
+          ca.sin6.sin6_family = AF_INET6;
+          if(makeIPv6sockaddr(str, &ca.sin6) == 0)
+            ++ok;
+        }
+      }
+    });
+  fmt::printf("makeIPv4sockaddr/makeIPv6sockaddr: %.1f ns/address, %d parsed\n", nsec/strings.size(), ok);
+
+  ok = 0;
+  nsec = timeIt([&]() {
+      for(const auto& str : strings)
+        if(ComboAddress::parse(str))
+          ++ok;
+    });
+  fmt::printf("ComboAddress::parse: %.1f ns/address, %d parsed\n", nsec/strings.size(), ok);
+}
+
+static void benchIntervalIndex()
+{
+  const unsigned int num = 4000000;
+  auto netmasks = randomNetmasks(num);
+  IntervalIndex<unsigned int>::Builder builder;
+  NetmaskTree<unsigned int> nmt;
+  for(unsigned int n = 0; n < num; ++n) {
+    builder.add(netmasks[n], n);
+    nmt.insert(netmasks[n], n);
+  }
+  IntervalIndex<unsigned int> index;
+  double nsec = timeIt([&]() { index = builder.build(); });
+  fmt::printf("%d prefixes: IntervalIndex build %.1f ms, %d ranges\n", num, nsec/1000000, index.size());
+
+  auto addresses = randomAddresses(10000000);
+  unsigned int matches = 0;
+  nsec = timeIt([&]() {
+      for(const auto& ca : addresses)
+        if(nmt.lookup(ca))
+          ++matches;
+    });
+  fmt::printf("NetmaskTree lookup: %.1f ns/address, %d matches\n", nsec/addresses.size(), matches);
+
+  matches = 0;
+  nsec = timeIt([&]() {
+      for(const auto& ca : addresses)
+        if(index.lookup(ca))
+          ++matches;
+    });
+  fmt::printf("IntervalIndex lookup: %.1f ns/address, %d matches\n", nsec/addresses.size(), matches);
+
+  matches = 0;
+  std::vector<const unsigned int*> results(1024);
+  nsec = timeIt([&]() {
+      for(size_t n = 0; n < addresses.size(); n += results.size()) {
+        size_t count = std::min(results.size(), addresses.size() - n);
+        index.lookupBatch(&addresses[n], count, results.data());
+        for(size_t i = 0; i < count; ++i)
+          if(results[i])
+            ++matches;
+      }
+    });
+  fmt::printf("IntervalIndex lookupBatch: %.1f ns/address, %d matches\n", nsec/addresses.size(), matches);
+}
+
+template<typename Address>
+static void benchAddressTable(const std::string& name, const std::vector<ComboAddress>& source)
+{
+  std::vector<Address> table;
+  double nsec = timeIt([&]() {
+      table.reserve(source.size());
+      for(const auto& ca : source)
+        table.push_back(Address(ca));
+    });
+  fmt::printf("%s: %.1f MB, fill %.1f ns/address\n", name, table.size() * sizeof(Address) / 1000000.0, nsec/table.size());
+
+  Netmask nm("10.0.0.0/8");
+  unsigned int matches = 0;
+  nsec = timeIt([&]() {
+      for(const auto& a : table)
+        if(nm.match(a))
+          ++matches;
+    });
+  fmt::printf("%s: Netmask::match scan %.1f ns/address, %d matches\n", name, nsec/table.size(), matches);
+
+  nsec = timeIt([&]() {
+      size_t sum = 0;
+      for(const auto& a : table)
+        sum += std::hash<Address>()(a);
+      g_sink = sum;
+    });
+  fmt::printf("%s: hash %.1f ns/address\n", name, nsec/table.size());
+
+  nsec = timeIt([&]() { std::sort(table.begin(), table.end()); });
+  fmt::printf("%s: sort %.1f ns/address\n", name, nsec/table.size());
+
+  std::unordered_set<Address> set;
+  nsec = timeIt([&]() {
+      for(const auto& a : table)
+        set.insert(a);
+    });
+  fmt::printf("%s: unordered_set insert %.1f ns/address\n", name, nsec/table.size());
+}
+
+static void benchPackedAddress()
+{
+  auto addresses = randomAddresses(10000000);
+  for(auto& ca : addresses)
+    ca.setPort(g_rng());
+  benchAddressTable<ComboAddress>("ComboAddress", addresses);
+  benchAddressTable<PackedAddress>("PackedAddress", addresses);
+}
+
+static void benchDir248()
+{
+  // roughly what a routing table looks like: mostly /24, some shorter, a few longer
+  const unsigned int num = 1000000;
+  Dir248 dir;
+  NetmaskTree<uint16_t> nmt;
+  for(unsigned int n = 0; n < num; ++n) {
+    unsigned int r = g_rng() % 100;
+    int bits = r < 60 ? 24 : r < 99 ? 16 + g_rng() % 8 : 25 + g_rng() % 8;
+    Netmask nm(randomIPv4(), bits);
+    dir.insert(nm, n % 1000);
+    nmt.insert(nm, n % 1000);
+  }
+  double nsec = timeIt([&]() { dir.commit(); });
+  fmt::printf("%d prefixes: Dir248 commit %.1f ms\n", num, nsec/1000000);
+
+  std::vector<ComboAddress> addresses;
+  for(unsigned int n = 0; n < 10000000; ++n)
+    addresses.push_back(randomIPv4());
+
+  unsigned int matches = 0;
+  nsec = timeIt([&]() {
+      for(const auto& ca : addresses)
+        if(nmt.lookup(ca))
+          ++matches;
+    });
+  fmt::printf("NetmaskTree: %.1f Mlookups/s, %d matches\n", addresses.size() * 1000.0 / nsec, matches);
+
+  Dir248::Reader reader(dir);
+  matches = 0;
+  nsec = timeIt([&]() {
+      for(const auto& ca : addresses)
+        if(reader.get().lookup(ca) != Dir248Table::noMatch)
+          ++matches;
+    });
+  fmt::printf("Dir248: %.1f Mlookups/s, %d matches\n", addresses.size() * 1000.0 / nsec, matches);
+}
+
+static void benchHeavyHitters()
+{
+  // a skewed mix: a few busy sources, lots of quiet ones, both IPv4 and IPv6
+  std::vector<ComboAddress> sources = randomAddresses(100000);
+  std::vector<ComboAddress> packets;
+  std::uniform_real_distribution<double> dist;
+  for(unsigned int n = 0; n < 10000000; ++n)
+    packets.push_back(sources[(size_t)(std::pow(dist(g_rng), 4) * sources.size())]);
+
+  ComboAddress prefix = packets[0];
+  double nsec = timeIt([&]() {
+      for(const auto& ca : packets) {
+        prefix = ca;
+        prefix.truncate(ca.sin4.sin_family == AF_INET ? 24 : 56);
+      }
+    });
+  g_sink = prefix.sin4.sin_port;
+  fmt::printf("truncate: %.1f ns/address\n", nsec / packets.size());
+
+  HeavyHitters hh({{24, 56}, {32, 128}}, 1000);
+  nsec = timeIt([&]() {
+      for(const auto& ca : packets)
+        hh.add(ca);
+    });
+  fmt::printf("HeavyHitters, 2 prefix lengths, 1000 counters: %.1f ns/update\n", nsec / packets.size());
+
+  std::unordered_map<ComboAddress, uint64_t> exact;
+  for(const auto& ca : packets)
+    ++exact[ca];
+  for(const auto& e : hh.top(1, 5))
+    fmt::printf("%s: %d (exact %d, error %d)\n", e.netmask, e.count, exact[e.netmask.getNetwork()], e.error);
+}
+
+int main(int argc, char** argv)
+try
+{
+  std::map<std::string, std::function<void()>> benchmarks{
+    {"netmasktree", benchNetmaskTree},
+    {"netmaskgroup", benchNetmaskGroup},
+    {"hash", benchHash},
+    {"format", benchFormat},
+    {"parse", benchParse},
+    {"intervalindex", benchIntervalIndex},
+    {"packedaddress", benchPackedAddress},
+    {"dir248", benchDir248},
+    {"heavyhitters", benchHeavyHitters}
+  };
+
+  std::vector<std::string> names;
+  for(int n = 1; n < argc; ++n)
+    names.push_back(argv[n]);
+  if(names.empty())
+    for(const auto& b : benchmarks)
+      names.push_back(b.first);
+
+  for(const auto& name : names) {
+    auto iter = benchmarks.find(name);
+    if(iter == benchmarks.end()) {
+      std::cerr << "Unknown benchmark '" << name << "'" << std::endl;
+      return EXIT_FAILURE;
+    }
+    fmt::printf("== %s\n", name);
+    iter->second();
+  }
+}
+catch(std::exception& e)
+{
+  std::cerr << "Fatal: " << e.what() << std::endl;
+  return EXIT_FAILURE;
+}
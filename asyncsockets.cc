@@ -0,0 +1,245 @@
+#include "asyncsockets.hh"
+
+#ifdef __cpp_impl_coroutine
+#include "swrappers.hh"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdexcept>
+#include <algorithm>
+#include <fmt/format.h>
+#include <fmt/printf.h>
+
+namespace {
+//! Coroutine that nobody awaits, it starts right away and frees itself when done
+struct Detached
+{
+  struct promise_type
+  {
+    Detached get_return_object()
+    {
+      return {};
+    }
+    std::suspend_never initial_suspend() noexcept
+    {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept
+    {
+      return {};
+    }
+    void return_void()
+    {}
+    void unhandled_exception()
+    {
+      std::terminate();
+    }
+  };
+};
+
+Detached runDetached(Task<void> task)
+{
+  co_await task;
+}
+}
+
+void spawn(Task<void>&& task)
+{
+  runDetached(std::move(task));
+}
+
+AsyncSocket::AsyncSocket(EventLoop& loop, int fd, size_t bufsize) : d_loop(loop), d_fd(fd), d_bufsize(bufsize ? bufsize : 1)
+{
+  SetNonBlocking(fd);
+}
+
+AsyncSocket::~AsyncSocket()
+{
+  for(Waiter* w : {d_reader, d_writer})
+    if(w && w->timer)
+      d_loop.timers().cancel(w->timer);
+  if(d_registered)
+    d_loop.remove(d_fd);
+}
+
+AsyncSocket::time_point AsyncSocket::deadlineFor(double timeout)
+{
+  if(timeout < 0)
+    return time_point::max();
+  return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+}
+
+void AsyncSocket::suspend(bool read, Waiter& waiter, std::coroutine_handle<> handle, const time_point& deadline)
+{
+  Waiter*& slot = read ? d_reader : d_writer;
+  if(slot)
+    throw std::runtime_error(fmt::sprintf("Two coroutines waiting to %s socket %d", read ? "read from" : "write to", d_fd));
+  // edge triggered, we only wait after the socket said EAGAIN, so there will be a new edge
+  if(!d_registered) {
+    d_loop.add(d_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, [this](int, uint32_t events) { onEvents(events); });
+    d_registered = true;
+  }
+  if(deadline != time_point::max())
+    waiter.timer = d_loop.timers().arm(deadline, [this, read]() { timedOut(read); });
+  waiter.handle = handle;
+  slot = &waiter;
+}
+
+void AsyncSocket::onEvents(uint32_t events)
+{
+  Waiter* reader = (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ? d_reader : nullptr;
+  Waiter* writer = (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) ? d_writer : nullptr;
+  if(reader)
+    d_reader = nullptr;
+  if(writer)
+    d_writer = nullptr;
+  for(Waiter* w : {reader, writer})
+    if(w && w->timer)
+      d_loop.timers().cancel(w->timer);
+  // the reader may finish and take this AsyncSocket with it, and the Waiters live in coroutine frames,
+  // so copy the handles out first, and touch neither members nor Waiters after the first resume()
+  std::coroutine_handle<> resumeReader = reader ? reader->handle : nullptr;
+  std::coroutine_handle<> resumeWriter = writer ? writer->handle : nullptr;
+  if(resumeReader)
+    resumeReader.resume();
+  if(resumeWriter)
+    resumeWriter.resume();
+}
+
+void AsyncSocket::timedOut(bool read)
+{
+  Waiter*& slot = read ? d_reader : d_writer;
+  Waiter* w = slot;
+  slot = nullptr;
+  w->timer = 0;
+  w->timedOut = true;
+  w->handle.resume();
+}
+
+//! Reads more into the buffer, which must be empty. Returns false on EOF.
+Task<bool> AsyncSocket::fill(time_point deadline)
+{
+  for(;;) {
+    if(d_buffer.empty())
+      d_buffer.resize(d_bufsize);
+    ssize_t res = read(d_fd, &d_buffer[0], d_buffer.size());
+    if(res > 0) {
+      d_pos = 0;
+      d_endpos = res;
+      co_return true;
+    }
+    if(!res)
+      co_return false;
+    if(errno == EINTR)
+      continue;
+    if(errno != EAGAIN)
+      throw std::runtime_error("Reading from socket: "+std::string(strerror(errno)));
+    // idle connections don't hold on to a buffer, with tens of thousands of them that adds up
+    std::vector<char>().swap(d_buffer);
+    if(!co_await readable(deadline))
+      throw std::runtime_error(fmt::sprintf("Timeout reading from socket %d", d_fd));
+  }
+}
+
+Task<void> asyncConnect(AsyncSocket& sock, const ComboAddress& remote, double timeout)
+{
+  auto deadline = AsyncSocket::deadlineFor(timeout);
+  if(!connect(sock.d_fd, (struct sockaddr*)&remote, remote.getSocklen()))
+    co_return;
+  if(errno != EINPROGRESS)
+    throw std::runtime_error(fmt::sprintf("connecting to %s failed: %s", remote.toStringWithPort(), strerror(errno)));
+  if(!co_await sock.writable(deadline))
+    throw std::runtime_error(fmt::sprintf("timeout while connecting to %s", remote.toStringWithPort()));
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+  if(getsockopt(sock.d_fd, SOL_SOCKET, SO_ERROR, (void*)&err, &errlen) < 0)
+    err = errno;
+  if(err)
+    throw std::runtime_error(fmt::sprintf("connecting to %s failed: %s", remote.toStringWithPort(), strerror(err)));
+}
+
+Task<std::string> asyncRead(AsyncSocket& sock, size_t limit, double timeout)
+{
+  if(sock.d_pos == sock.d_endpos && !co_await sock.fill(AsyncSocket::deadlineFor(timeout)))
+    co_return std::string();
+  size_t len = std::min(limit, sock.d_endpos - sock.d_pos);
+  std::string ret(&sock.d_buffer[sock.d_pos], len);
+  sock.d_pos += len;
+  co_return ret;
+}
+
+Task<void> asyncWriten(AsyncSocket& sock, std::string_view content, double timeout)
+{
+  auto deadline = AsyncSocket::deadlineFor(timeout);
+  size_t pos = 0;
+  while(pos < content.size()) {
+    // a peer that went away should be an exception, not a SIGPIPE that ends the whole server
+    ssize_t res = send(sock.d_fd, content.data() + pos, content.size() - pos, MSG_NOSIGNAL);
+    if(res >= 0) {
+      pos += res;
+      continue;
+    }
+    if(errno == EINTR)
+      continue;
+    if(errno != EAGAIN)
+      throw std::runtime_error("Writing to socket: "+std::string(strerror(errno)));
+    if(!co_await sock.writable(deadline))
+      throw std::runtime_error(fmt::sprintf("Timeout writing to socket %d", sock.d_fd));
+  }
+}
+
+Task<bool> asyncGetLine(AsyncSocket& sock, std::string& line, double timeout)
+{
+  auto deadline = AsyncSocket::deadlineFor(timeout);
+  line.clear();
+  for(;;) {
+    if(sock.d_pos == sock.d_endpos && !co_await sock.fill(deadline))
+      co_return !line.empty();
+    const char* start = &sock.d_buffer[sock.d_pos];
+    size_t avail = sock.d_endpos - sock.d_pos;
+    auto nl = (const char*)memchr(start, '\n', avail);
+    size_t len = nl ? nl - start + 1 : avail;
+    line.append(start, len);
+    sock.d_pos += len;
+    if(nl)
+      co_return true;
+  }
+}
+
+Task<int> asyncAccept(AsyncSocket& sock, ComboAddress& remote, double timeout)
+{
+  auto deadline = AsyncSocket::deadlineFor(timeout);
+  for(;;) {
+    socklen_t remlen = sizeof(remote);
+    int fd = accept4(sock.d_fd, (struct sockaddr*)&remote, &remlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd >= 0)
+      co_return fd;
+    // the connection went away again before we got to it, wait for the next one
+    if(errno == EINTR || errno == ECONNABORTED)
+      continue;
+    if(errno != EAGAIN)
+      throw std::runtime_error("Accepting connection: "+std::string(strerror(errno)));
+    if(!co_await sock.readable(deadline))
+      throw std::runtime_error(fmt::sprintf("Timeout accepting connection on socket %d", sock.d_fd));
+  }
+}
+
+Task<size_t> asyncRecvfrom(AsyncSocket& sock, char* buf, size_t len, ComboAddress& from, double timeout)
+{
+  auto deadline = AsyncSocket::deadlineFor(timeout);
+  for(;;) {
+    socklen_t fromlen = sizeof(from);
+    ssize_t res = recvfrom(sock.d_fd, buf, len, 0, (struct sockaddr*)&from, &fromlen);
+    if(res >= 0)
+      co_return res;
+    if(errno == EINTR)
+      continue;
+    if(errno != EAGAIN)
+      throw std::runtime_error("Receiving datagram: "+std::string(strerror(errno)));
+    if(!co_await sock.readable(deadline))
+      throw std::runtime_error(fmt::sprintf("Timeout receiving datagram on socket %d", sock.d_fd));
+  }
+}
+#endif
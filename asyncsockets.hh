@@ -0,0 +1,254 @@
+#pragma once
+#include "eventloop.hh"
+#include "comboaddress.hh"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <exception>
+#include <utility>
+#include <limits>
+#include <chrono>
+#include <type_traits>
+
+/** \file asyncsockets.hh
+    \brief Coroutine versions of the socket operations, so one thread can serve many thousands of connections
+
+    Needs compiler support for coroutines: C++20, or -fcoroutines with g++ in C++17 mode, as the Makefile does.
+    Without it, this header declares nothing.
+*/
+
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+
+/** The result of a coroutine that can be co_await'ed, for example Task<std::string>. It starts running when
+    awaited, and the awaiting coroutine continues when it is done, with its result or its exception.
+    To start a Task<void> that runs by itself, use spawn(). */
+template<typename T>
+class Task
+{
+public:
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> handle_type;
+
+  struct FinalAwaiter
+  {
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+    // continues straight with whoever awaited us, without growing the stack
+    std::coroutine_handle<> await_suspend(handle_type h) noexcept
+    {
+      auto continuation = h.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() const noexcept
+    {}
+  };
+
+  struct PromiseBase
+  {
+    std::suspend_always initial_suspend() noexcept
+    {
+      return {};
+    }
+    FinalAwaiter final_suspend() noexcept
+    {
+      return {};
+    }
+    void unhandled_exception()
+    {
+      exception = std::current_exception();
+    }
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+  };
+
+  struct ValuePromise : PromiseBase
+  {
+    template<typename U>
+    void return_value(U&& value)
+    {
+      result.emplace(std::forward<U>(value));
+    }
+    T get()
+    {
+      if(this->exception)
+        std::rethrow_exception(this->exception);
+      return std::move(*result);
+    }
+    std::optional<T> result;
+  };
+
+  struct VoidPromise : PromiseBase
+  {
+    void return_void()
+    {}
+    void get()
+    {
+      if(this->exception)
+        std::rethrow_exception(this->exception);
+    }
+  };
+
+  struct promise_type : std::conditional_t<std::is_void_v<T>, VoidPromise, ValuePromise>
+  {
+    Task get_return_object()
+    {
+      return Task(handle_type::from_promise(*this));
+    }
+  };
+
+  Task(Task&& rhs) noexcept : d_handle(std::exchange(rhs.d_handle, nullptr))
+  {}
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task()
+  {
+    if(d_handle)
+      d_handle.destroy();
+  }
+
+  bool await_ready() const noexcept
+  {
+    return false;
+  }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+  {
+    d_handle.promise().continuation = awaiting;
+    return d_handle;
+  }
+  T await_resume()
+  {
+    return d_handle.promise().get();
+  }
+
+private:
+  explicit Task(handle_type handle) : d_handle(handle)
+  {}
+  handle_type d_handle;
+};
+
+/** Starts \p task, which then runs by itself, usually until it waits for a socket, at which point spawn()
+    returns. The EventLoop continues it later. As with std::thread, an exception that escapes the task
+    calls std::terminate(), so catch them in the task. */
+void spawn(Task<void>&& task);
+
+/** A non-blocking socket used from coroutines running on an EventLoop. Like SocketCommunicator,
+    it sets the socket to non-blocking and buffers reads, but does not close the socket.
+    It registers the socket with the EventLoop the first time an operation has to wait, and removes it when destroyed.
+    At most one coroutine can wait to read, and one to write, at the same time.
+\code{.cpp}
+    Task<void> serve(EventLoop& loop, int fd)
+    {
+      AsyncSocket sock(loop, fd);
+      std::string line;
+      while(co_await asyncGetLine(sock, line, 10))
+        co_await asyncWriten(sock, line, 10);
+      ...
+    }
+    ...
+    spawn(serve(loop, fd));
+    loop.run();
+\endcode
+    Timeouts are in seconds for the whole operation, negative is infinite. A timeout is an exception, as are errors.
+*/
+class AsyncSocket
+{
+public:
+  //! Use \p fd with \p loop, reading \p bufsize bytes at a time
+  AsyncSocket(EventLoop& loop, int fd, size_t bufsize=2048);
+  ~AsyncSocket();
+  AsyncSocket(const AsyncSocket&) = delete;
+  AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+  operator int() const
+  {
+    return d_fd;
+  }
+
+private:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  struct Waiter
+  {
+    std::coroutine_handle<> handle;
+    TimerWheel::TimerId timer{0};
+    bool timedOut{false};
+  };
+
+  //! co_await'ing this waits until the socket is readable or writable, or \p deadline passes, in which case it returns false
+  class Wait
+  {
+  public:
+    Wait(AsyncSocket& sock, bool read, const time_point& deadline) : d_sock(sock), d_deadline(deadline), d_read(read)
+    {}
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      d_sock.suspend(d_read, d_waiter, handle, d_deadline);
+    }
+    bool await_resume() const noexcept
+    {
+      return !d_waiter.timedOut;
+    }
+  private:
+    AsyncSocket& d_sock;
+    time_point d_deadline;
+    Waiter d_waiter;
+    bool d_read;
+  };
+
+  static time_point deadlineFor(double timeout);
+  Wait readable(const time_point& deadline)
+  {
+    return Wait(*this, true, deadline);
+  }
+  Wait writable(const time_point& deadline)
+  {
+    return Wait(*this, false, deadline);
+  }
+  void suspend(bool read, Waiter& waiter, std::coroutine_handle<> handle, const time_point& deadline);
+  void onEvents(uint32_t events);
+  void timedOut(bool read);
+  Task<bool> fill(time_point deadline);
+
+  friend Task<void> asyncConnect(AsyncSocket& sock, const ComboAddress& remote, double timeout);
+  friend Task<std::string> asyncRead(AsyncSocket& sock, size_t limit, double timeout);
+  friend Task<void> asyncWriten(AsyncSocket& sock, std::string_view content, double timeout);
+  friend Task<bool> asyncGetLine(AsyncSocket& sock, std::string& line, double timeout);
+  friend Task<int> asyncAccept(AsyncSocket& sock, ComboAddress& remote, double timeout);
+  friend Task<size_t> asyncRecvfrom(AsyncSocket& sock, char* buf, size_t len, ComboAddress& from, double timeout);
+
+  EventLoop& d_loop;
+  int d_fd;
+  Waiter* d_reader{nullptr};
+  Waiter* d_writer{nullptr};
+  bool d_registered{false};
+  std::vector<char> d_buffer;   // freed while waiting for data
+  size_t d_bufsize;
+  size_t d_pos{0}, d_endpos{0};
+};
+
+//! Connect to \p remote
+Task<void> asyncConnect(AsyncSocket& sock, const ComboAddress& remote, double timeout=-1);
+
+//! Read at most \p limit bytes, whatever is available. An empty string means EOF.
+Task<std::string> asyncRead(AsyncSocket& sock, size_t limit=std::numeric_limits<size_t>::max(), double timeout=-1);
+
+//! Write all of \p content, which has to stay alive until this is done
+Task<void> asyncWriten(AsyncSocket& sock, std::string_view content, double timeout=-1);
+
+//! Get a whole line of text, including the newline. Returns false on EOF. Will return a partial last line.
+Task<bool> asyncGetLine(AsyncSocket& sock, std::string& line, double timeout=-1);
+
+//! Accept a connection on listening socket \p sock. Returns the new socket, which is non-blocking already.
+Task<int> asyncAccept(AsyncSocket& sock, ComboAddress& remote, double timeout=-1);
+
+//! Receive a datagram into \p buf, returns its length
+Task<size_t> asyncRecvfrom(AsyncSocket& sock, char* buf, size_t len, ComboAddress& from, double timeout=-1);
+#endif
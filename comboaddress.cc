@@ -1,32 +1,406 @@
 #include "comboaddress.hh"
+#include <random>
+#include <net/if.h>
 
 void ComboAddress::truncate(unsigned int bits)
 {
-  uint8_t* start;
-  int len=4;
   if(sin4.sin_family==AF_INET) {
     if(bits >= 32)
       return;
-    start = (uint8_t*)&sin4.sin_addr.s_addr;
-    len=4;
+    sin4.sin_addr.s_addr &= htonl(bits ? ~0U << (32 - bits) : 0);
+    return;
+  }
+  if(bits >= 128)
+    return;
+
+  // a b c d, to truncate to 40 bits we keep 'a', and the top 8 bits of 'b'
+  uint32_t words[4];
+  memcpy(words, &sin6.sin6_addr.s6_addr, sizeof(words));
+  for(int n = 0; n < 4; ++n) {
+    int keep = (int)bits - 32 * n;
+    if(keep >= 32)
+      continue;
+    words[n] &= htonl(keep > 0 ? ~0U << (32 - keep) : 0);
+  }
+  memcpy(&sin6.sin6_addr.s6_addr, words, sizeof(words));
+}
+
+static char* writeDecimal(char* p, unsigned int val)
+{
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + val % 10;
+    val /= 10;
+  } while(val);
+  while(n)
+    *p++ = tmp[--n];
+  return p;
+}
+
+static char* writeIPv4(char* p, const uint8_t* addr)
+{
+  for(int n = 0; n < 4; ++n) {
+    if(n)
+      *p++ = '.';
+    p = writeDecimal(p, addr[n]);
+  }
+  return p;
+}
+
+// RFC 5952: lowercase, no leading zeroes, :: replaces the longest (first if tied) run of 2 or more zero groups
+static char* writeIPv6(char* p, const struct sockaddr_in6& sin6)
+{
+  const uint8_t* addr = (const uint8_t*)&sin6.sin6_addr.s6_addr;
+  uint16_t groups[8];
+  for(int n = 0; n < 8; ++n)
+    groups[n] = (addr[2*n] << 8) | addr[2*n + 1];
+
+  if(!groups[0] && !groups[1] && !groups[2] && !groups[3] && !groups[4] && groups[5] == 0xffff) {
+    memcpy(p, "::ffff:", 7);
+    p = writeIPv4(p + 7, addr + 12);
   }
   else {
-    if(bits >= 128)
-      return;
-    start = (uint8_t*)&sin6.sin6_addr.s6_addr;
-    len=16;
+    int best = -1, bestlen = 1;
+    for(int n = 0; n < 8;) {
+      if(groups[n]) {
+        ++n;
+        continue;
+      }
+      int end = n;
+      while(end < 8 && !groups[end])
+        ++end;
+      if(end - n > bestlen) {
+        best = n;
+        bestlen = end - n;
+      }
+      n = end;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    for(int n = 0; n < 8; ++n) {
+      if(n == best) {
+        *p++ = ':';
+        *p++ = ':';
+        n += bestlen - 1;
+        continue;
+      }
+      if(n && n != best + bestlen)
+        *p++ = ':';
+      bool started = false;
+      for(int shift = 12; shift >= 0; shift -= 4) {
+        unsigned int nibble = (groups[n] >> shift) & 0xf;
+        if(nibble || started || !shift) {
+          *p++ = hex[nibble];
+          started = true;
+        }
+      }
+    }
   }
 
-  auto tozero= len*8 - bits; // if set to 22, this will clear 1 byte, as it should
+  if(sin6.sin6_scope_id) {
+    *p++ = '%';
+    char ifname[IF_NAMESIZE];
+    if(if_indextoname(sin6.sin6_scope_id, ifname)) {
+      size_t len = strnlen(ifname, sizeof(ifname) - 1);
+      memcpy(p, ifname, len);
+      p += len;
+    }
+    else
+      p = writeDecimal(p, sin6.sin6_scope_id);
+  }
+  return p;
+}
+
+// copies [tmp, end) to buf with a terminating 0, if it fits
+static size_t finishChars(const char* tmp, const char* end, char* buf, size_t len)
+{
+  size_t ret = end - tmp;
+  if(ret >= len)
+    return 0;
+  memcpy(buf, tmp, ret);
+  buf[ret] = 0;
+  return ret;
+}
+
+static char* writeAddress(char* p, const ComboAddress& ca)
+{
+  if(ca.sin4.sin_family == AF_INET)
+    return writeIPv4(p, (const uint8_t*)&ca.sin4.sin_addr.s_addr);
+  if(ca.sin4.sin_family == AF_INET6)
+    return writeIPv6(p, ca.sin6);
+  memcpy(p, "invalid", 7);
+  return p + 7;
+}
+
+size_t ComboAddress::toChars(char* buf, size_t len) const
+{
+  char tmp[maxStringLength];
+  return finishChars(tmp, writeAddress(tmp, *this), buf, len);
+}
+
+size_t ComboAddress::toCharsWithPort(char* buf, size_t len) const
+{
+  char tmp[maxStringLength];
+  char* p = tmp;
+  if(sin4.sin_family == AF_INET6)
+    *p++ = '[';
+  p = writeAddress(p, *this);
+  if(sin4.sin_family == AF_INET6)
+    *p++ = ']';
+  *p++ = ':';
+  p = writeDecimal(p, ntohs(sin4.sin_port));
+  return finishChars(tmp, p, buf, len);
+}
+
+size_t Netmask::toChars(char* buf, size_t len) const
+{
+  char tmp[maxStringLength];
+  char* p = writeAddress(tmp, d_network);
+  *p++ = '/';
+  p = writeDecimal(p, d_bits);
+  return finishChars(tmp, p, buf, len);
+}
+
+// strict decimal, no sign, no leading zeroes, at most 'max'
+static bool parseDecimal(std::string_view str, unsigned int max, unsigned int& val)
+{
+  if(str.empty() || str.size() > 5 || (str[0] == '0' && str.size() > 1))
+    return false;
+  val = 0;
+  for(char c : str) {
+    if(c < '0' || c > '9')
+      return false;
+    val = val * 10 + (c - '0');
+  }
+  return val <= max;
+}
 
-  memset(start + len - tozero/8, 0, tozero/8); // blot out the whole bytes on the right
-  
-  auto bitsleft=tozero % 8; // 2 bits left to clear
+// dotted quad only, no leading zeroes as inet_aton would take those as octal
+static bool parseIPv4(std::string_view str, uint8_t* out)
+{
+  int octet = 0, digits = 0;
+  unsigned int val = 0;
+  for(char c : str) {
+    if(c == '.') {
+      if(!digits || octet == 3)
+        return false;
+      out[octet++] = val;
+      val = 0;
+      digits = 0;
+      continue;
+    }
+    if(c < '0' || c > '9' || (digits && !val))
+      return false;
+    val = val * 10 + (c - '0');
+    if(val > 255)
+      return false;
+    ++digits;
+  }
+  if(!digits || octet != 3)
+    return false;
+  out[3] = val;
+  return true;
+}
 
-  // a b c d, to truncate to 22 bits, we just zeroed 'd' and need to zero 2 bits from c
-  // so and by '11111100', which is ~((1<<2)-1)  = ~3
-  uint8_t* place = start + len - 1 - tozero/8; 
-  *place &= (~((1<<bitsleft)-1));
+static int hexValue(char c)
+{
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// same rules as inet_pton(AF_INET6), including a trailing dotted quad
+static bool parseIPv6(std::string_view str, uint8_t* out)
+{
+  uint16_t groups[8];
+  int num = 0, gap = -1;
+  size_t pos = 0;
+  if(str.size() >= 2 && str[0] == ':' && str[1] == ':') {
+    gap = 0;
+    pos = 2;
+  }
+  while(pos < str.size()) {
+    if(num == 8)
+      return false;
+    size_t start = pos;
+    unsigned int val = 0;
+    int digit;
+    while(pos < str.size() && pos - start < 5 && (digit = hexValue(str[pos])) >= 0) {
+      val = val * 16 + digit;
+      ++pos;
+    }
+    if(pos < str.size() && str[pos] == '.') {
+      uint8_t ipv4[4];
+      if(num > 6 || !parseIPv4(str.substr(start), ipv4))
+        return false;
+      groups[num++] = (ipv4[0] << 8) | ipv4[1];
+      groups[num++] = (ipv4[2] << 8) | ipv4[3];
+      break;
+    }
+    if(pos == start || pos - start > 4)
+      return false;
+    groups[num++] = val;
+    if(pos == str.size())
+      break;
+    if(str[pos++] != ':' || pos == str.size())
+      return false;
+    if(str[pos] == ':') {
+      if(gap >= 0)
+        return false;
+      gap = num;
+      ++pos;
+    }
+  }
+  if(gap < 0 ? num != 8 : num == 8)
+    return false;
+
+  memset(out, 0, 16);
+  int tail = gap < 0 ? 0 : num - gap;
+  for(int n = 0; n < num - tail; ++n) {
+    out[2*n] = groups[n] >> 8;
+    out[2*n + 1] = groups[n];
+  }
+  for(int n = 0; n < tail; ++n) {
+    out[16 - 2*tail + 2*n] = groups[gap + n] >> 8;
+    out[16 - 2*tail + 2*n + 1] = groups[gap + n];
+  }
+  return true;
+}
+
+// address with optional %scope, which is an interface name or index
+static bool parseScopedIPv6(std::string_view str, struct sockaddr_in6& sin6)
+{
+  auto pos = str.find('%');
+  if(!parseIPv6(str.substr(0, pos), (uint8_t*)&sin6.sin6_addr.s6_addr))
+    return false;
+  if(pos == std::string_view::npos)
+    return true;
+  auto scope = str.substr(pos + 1);
+  unsigned int index = 0;
+  if(scope.empty() || scope.size() >= IF_NAMESIZE)
+    return false;
+  if(scope.find_first_not_of("0123456789") == std::string_view::npos) {
+    for(char c : scope)
+      index = index * 10 + (c - '0');
+  }
+  else {
+    char ifname[IF_NAMESIZE];
+    memcpy(ifname, scope.data(), scope.size());
+    ifname[scope.size()] = 0;
+    index = if_nametoindex(ifname);
+  }
+  if(!index)
+    return false;
+  sin6.sin6_scope_id = index;
+  return true;
+}
+
+std::optional<ComboAddress> ComboAddress::parse(std::string_view str, uint16_t port)
+{
+  ComboAddress ret;
+  // the default constructor leaves the rest of the union alone, but these bytes go to bind(), connect() and memcmp()
+  memset(&ret.sin6, 0, sizeof(ret.sin6));
+  ret.sin4.sin_family = AF_INET;
+  unsigned int strport = 0;
+  if(str.empty())
+    return std::nullopt;
+
+  auto colon = str.find(':');
+  if(str[0] == '[') { // [::1]:53 style
+    auto pos = str.find(']');
+    if(pos == std::string_view::npos || pos + 2 > str.size() || str[pos + 1] != ':')
+      return std::nullopt;
+    if(!parseDecimal(str.substr(pos + 2), 65535, strport))
+      return std::nullopt;
+    str = str.substr(1, pos - 1);
+    colon = 0;
+  }
+  else if(colon != std::string_view::npos && str.find(':', colon + 1) == std::string_view::npos) { // 1.2.3.4:80
+    if(!parseDecimal(str.substr(colon + 1), 65535, strport))
+      return std::nullopt;
+    str = str.substr(0, colon);
+    colon = std::string_view::npos;
+  }
+
+  if(colon == std::string_view::npos) {
+    if(!parseIPv4(str, (uint8_t*)&ret.sin4.sin_addr.s_addr))
+      return std::nullopt;
+  }
+  else {
+    ret.sin6.sin6_family = AF_INET6;
+    if(!parseScopedIPv6(str, ret.sin6))
+      return std::nullopt;
+  }
+  ret.sin4.sin_port = htons(strport ? strport : port); // 'str' overrides port!
+  return ret;
+}
+
+static uint64_t rotl64(uint64_t x, int b)
+{
+  return (x << b) | (x >> (64 - b));
+}
+
+static void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+{
+  v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+  v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+  v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+  v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+}
+
+// SipHash-1-3 over whole 64 bit words, 'len' is the length in bytes that goes into the final word
+static uint64_t sipHash13(const uint64_t* words, int num, uint64_t len, uint64_t k0, uint64_t k1)
+{
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+  for(int n = 0; n < num; ++n) {
+    v3 ^= words[n];
+    sipRound(v0, v1, v2, v3);
+    v0 ^= words[n];
+  }
+  uint64_t b = len << 56;
+  v3 ^= b;
+  sipRound(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  for(int n = 0; n < 3; ++n)
+    sipRound(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static std::pair<uint64_t, uint64_t> getProcessHashKey()
+{
+  std::random_device rd;
+  auto word = [&rd]() { return ((uint64_t)rd() << 32) | rd(); };
+  return {word(), word()};
+}
+
+ComboAddress::seededHash::seededHash(bool withPort) : d_withPort(withPort)
+{
+  static const auto key = getProcessHashKey();
+  d_k0 = key.first;
+  d_k1 = key.second;
+}
+
+size_t ComboAddress::seededHash::operator()(const ComboAddress& ca) const
+{
+  uint64_t words[3];
+  uint64_t tail = d_withPort ? ca.sin4.sin_port : 0;
+  if(ca.sin4.sin_family == AF_INET) {
+    words[0] = ((uint64_t)ca.sin4.sin_addr.s_addr << 16) | tail;
+    return sipHash13(words, 1, 6, d_k0, d_k1);
+  }
+  memcpy(words, &ca.sin6.sin6_addr.s6_addr, 16);
+  words[2] = tail;
+  return sipHash13(words, 3, 18, d_k0, d_k1);
 }
 
 int makeIPv6sockaddr(const std::string& addr, struct sockaddr_in6* ret)
@@ -11,54 +11,176 @@
 #include <sstream>
 #include <tuple>
 #include <string.h>
+#include <stdint.h>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <type_traits>
 
 int makeIPv6sockaddr(const std::string& addr, struct sockaddr_in6* ret);
 int makeIPv4sockaddr(const std::string& str, struct sockaddr_in* ret);
 
 constexpr uint32_t chtonl(uint32_t s)
 {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return s;
+#else
     return (
         ((s & 0x000000FF) << 24) | ((s & 0x0000FF00) << 8)
       | ((s & 0xFF000000) >> 24) | ((s & 0x00FF0000) >> 8)
     );
+#endif
 }
 
-constexpr struct sockaddr_in operator "" _ipv4(const char* p, size_t l)
+constexpr uint16_t chtons(uint16_t s)
 {
-  struct sockaddr_in ret={};
-  ret.sin_addr.s_addr=0;
-  ret.sin_family=AF_INET;
-  
-  uint8_t octet=0;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return s;
+#else
+    return ((s & 0x00FF) << 8) | ((s & 0xFF00) >> 8);
+#endif
+}
+
+/* Helpers for the _ipv4, _ipv6, _ca and _nm user literals. These throw on malformed input, which makes
+   the literal a compile error when it is evaluated at compile time. With C++20 the literals are consteval,
+   so that is always. */
+#ifdef __cpp_consteval
+#define SIMPLESOCKETS_LITERAL consteval
+#else
+#define SIMPLESOCKETS_LITERAL constexpr
+#endif
+
+constexpr size_t literalFind(const char* p, size_t l, char c)
+{
+  for(size_t n = 0; n < l; ++n)
+    if(p[n] == c)
+      return n;
+  return l;
+}
+
+constexpr uint32_t parseLiteralNumber(const char* p, size_t l, uint32_t max)
+{
+  if(!l)
+    throw std::invalid_argument("Missing number in address literal");
+  uint64_t ret = 0;
+  for(size_t n = 0; n < l; ++n) {
+    if(p[n] < '0' || p[n] > '9')
+      throw std::invalid_argument("Invalid digit in address literal");
+    ret = ret * 10 + (p[n] - '0');
+    if(ret > max)
+      throw std::invalid_argument("Number out of range in address literal");
+  }
+  return ret;
+}
 
-  size_t n=0;
-  for(; n < l; ++n) {
-    if(p[n]==':')
+//! Parses a dotted quad, returns it in host order
+constexpr uint32_t parseLiteralIPv4Address(const char* p, size_t l)
+{
+  uint32_t ret = 0;
+  int octets = 0;
+  size_t start = 0;
+  for(size_t n = 0; n <= l; ++n) {
+    if(n == l || p[n] == '.') {
+      if(octets == 4)
+        throw std::invalid_argument("Too many octets in IPv4 literal");
+      ret = ret * 0x100 + parseLiteralNumber(p + start, n - start, 255);
+      ++octets;
+      start = n + 1;
+    }
+  }
+  if(octets != 4)
+    throw std::invalid_argument("Too few octets in IPv4 literal");
+  return ret;
+}
+
+constexpr int literalHexValue(char c)
+{
+  return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+//! Parses an IPv6 address, without brackets or scope, into 16 bytes at \p out, which must be zeroed
+constexpr void parseLiteralIPv6Address(const char* p, size_t l, uint8_t* out)
+{
+  uint16_t groups[8]{};
+  int num = 0, gap = -1;
+  size_t n = 0;
+  if(l >= 2 && p[0] == ':' && p[1] == ':') {
+    gap = 0;
+    n = 2;
+  }
+  while(n < l) {
+    if(num == 8)
+      throw std::invalid_argument("Too many groups in IPv6 literal");
+    size_t start = n;
+    unsigned int val = 0;
+    for(; n < l && literalHexValue(p[n]) >= 0; ++n) {
+      if(n - start == 4)
+        throw std::invalid_argument("Group too long in IPv6 literal");
+      val = val * 16 + literalHexValue(p[n]);
+    }
+    if(n < l && p[n] == '.') {
+      if(num > 6)
+        throw std::invalid_argument("No room for embedded IPv4 in IPv6 literal");
+      uint32_t ipv4 = parseLiteralIPv4Address(p + start, l - start);
+      groups[num++] = ipv4 >> 16;
+      groups[num++] = ipv4 & 0xffff;
       break;
-    if(p[n]=='.') {
-      ret.sin_addr.s_addr*=0x100;
-      ret.sin_addr.s_addr+=octet;
-      octet=0;
     }
-    else {
-      octet*=10;
-      octet+=p[n]-'0';
+    if(n == start)
+      throw std::invalid_argument("Empty group in IPv6 literal");
+    groups[num++] = val;
+    if(n == l)
+      break;
+    if(p[n++] != ':' || n == l)
+      throw std::invalid_argument("Invalid character in IPv6 literal");
+    if(p[n] == ':') {
+      if(gap >= 0)
+        throw std::invalid_argument("Multiple :: in IPv6 literal");
+      gap = num;
+      ++n;
     }
   }
-  ret.sin_addr.s_addr*=0x100;
-  ret.sin_addr.s_addr+=octet;
+  if(gap < 0 ? num != 8 : num == 8)
+    throw std::invalid_argument("Wrong number of groups in IPv6 literal");
 
-  ret.sin_addr.s_addr = chtonl(ret.sin_addr.s_addr);
-  
-  if(p[n]==':') {
-    for(++n; n < l; ++n) {
-      ret.sin_port*=10;
-      ret.sin_port += p[n]-'0';
-    }
-    ret.sin_port = 0x100 * (ret.sin_port&0xff) + (ret.sin_port/0x100);
+  int tail = gap < 0 ? 0 : num - gap;
+  for(int g = 0; g < num; ++g) {
+    int pos = g < num - tail ? g : 8 - num + g;
+    out[2*pos] = groups[g] >> 8;
+    out[2*pos + 1] = groups[g] & 0xff;
   }
+}
+
+//! Parses ::1, fe80::1%2 or [::1]:53 style literals. Scopes must be numeric.
+constexpr struct sockaddr_in6 parseLiteralIPv6(const char* p, size_t l)
+{
+  struct sockaddr_in6 ret{};
+  ret.sin6_family = AF_INET6;
+  if(l && p[0] == '[') {
+    size_t close = literalFind(p, l, ']');
+    if(close == l || close + 1 == l || p[close + 1] != ':')
+      throw std::invalid_argument("Bracketed IPv6 literal needs ]:port");
+    ret.sin6_port = chtons(parseLiteralNumber(p + close + 2, l - close - 2, 65535));
+    ++p;
+    l = close - 1;
+  }
+  size_t percent = literalFind(p, l, '%');
+  if(percent != l)
+    ret.sin6_scope_id = parseLiteralNumber(p + percent + 1, l - percent - 1, 0xffffffff);
+  parseLiteralIPv6Address(p, percent, ret.sin6_addr.s6_addr);
   return ret;
+}
 
+//! "1.2.3.4"_ipv4 or "1.2.3.4:80"_ipv4, makes a struct sockaddr_in
+SIMPLESOCKETS_LITERAL struct sockaddr_in operator "" _ipv4(const char* p, size_t l)
+{
+  struct sockaddr_in ret={};
+  ret.sin_family=AF_INET;
+  size_t colon = literalFind(p, l, ':');
+  ret.sin_addr.s_addr = chtonl(parseLiteralIPv4Address(p, colon));
+  if(colon != l)
+    ret.sin_port = chtons(parseLiteralNumber(p + colon + 1, l - colon - 1, 65535));
+  return ret;
 }
 
 /** The ComboAddress holds an IPv4 or an IPv6 endpoint, including a source port.
@@ -118,25 +240,59 @@ union ComboAddress {
   {
     return rhs.operator<(*this);
   }
-  /*
+  //! Mixes all bits of \p x into all other bits, fast and good enough for hash tables
+  static uint64_t mix64(uint64_t x)
+  {
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ULL;
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ULL;
+    x ^= x >> 32;
+    return x;
+  }
+
+  //! Hash of the address, mixed with \p extra. Reads the address as whole words.
+  uint64_t hashAddress(uint64_t extra=0) const
+  {
+    if(sin4.sin_family == AF_INET)
+      return mix64(((uint64_t)sin4.sin_addr.s_addr << 16) ^ (extra << 48) ^ extra);
+    uint64_t words[2];
+    memcpy(words, &sin6.sin6_addr.s6_addr, sizeof(words));
+    return mix64(words[0] ^ mix64(words[1] ^ extra));
+  }
+
+  //! Hashes only the address, for use with addressOnlyEqual
   struct addressOnlyHash
   {
-    uint32_t operator()(const ComboAddress& ca) const 
-    { 
-      const unsigned char* start;
-      int len;
-      if(ca.sin4.sin_family == AF_INET) {
-        start =(const unsigned char*)&ca.sin4.sin_addr.s_addr;
-        len=4;
-      }
-      else {
-        start =(const unsigned char*)&ca.sin6.sin6_addr.s6_addr;
-        len=16;
-      }
-      return burtle(start, len, 0);
+    size_t operator()(const ComboAddress& ca) const
+    {
+      return ca.hashAddress();
     }
   };
-  */
+
+  //! Hashes address and port, consistent with operator==. This is what std::hash<ComboAddress> uses.
+  struct addressPortHash
+  {
+    size_t operator()(const ComboAddress& ca) const
+    {
+      return ca.hashAddress(ca.sin4.sin_port);
+    }
+  };
+
+  /** SipHash-1-3 of address, and optionally port, under a secret key. Use this instead of
+      addressOnlyHash or addressPortHash when remote parties pick the addresses, so they can't
+      make your hash table degrade by sending traffic from colliding addresses. If not passed
+      a key, a random per-process key is used. */
+  struct seededHash
+  {
+    explicit seededHash(bool withPort=true);
+    seededHash(uint64_t k0, uint64_t k1, bool withPort=true) : d_k0(k0), d_k1(k1), d_withPort(withPort)
+    {}
+    size_t operator()(const ComboAddress& ca) const;
+
+    uint64_t d_k0, d_k1;
+    bool d_withPort;
+  };
 
   //! Convenience comparator that compares regardless of port. 
   struct addressOnlyLessThan
@@ -199,9 +355,12 @@ union ComboAddress {
     setSockaddr((const struct sockaddr*)sa, sizeof(struct sockaddr_in));
   }
   //! Make a ComboAddress from a traditional sockaddr
-  ComboAddress(const struct sockaddr_in& sa) {
-    setSockaddr((const struct sockaddr*)&sa, sizeof(struct sockaddr_in));
-  }
+  constexpr ComboAddress(const struct sockaddr_in& sa) : sin4(sa)
+  {}
+
+  //! Make a ComboAddress from a traditional sockaddr_in6
+  constexpr ComboAddress(const struct sockaddr_in6& sa) : sin6(sa)
+  {}
 
   void setSockaddr(const struct sockaddr *sa, socklen_t salen) {
     if (salen > sizeof(struct sockaddr_in6)) throw std::runtime_error("ComboAddress can't handle other than sockaddr_in or sockaddr_in6");
@@ -219,20 +378,32 @@ union ComboAddress {
       ComboAddress("[fe80::1%eth0]:80");
       ComboAddress("[fe::1%eth0]:80", 1234);
   */
-  explicit ComboAddress(const std::string& str, uint16_t port=0)
+  explicit ComboAddress(std::string_view str, uint16_t port=0)
   {
+    if(auto ca = parse(str, port)) {
+      *this = *ca;
+      return;
+    }
+    // parse() is strict, the classic functions also know about things like 127.1 and 0x7f.0.0.1
+    std::string copy(str);
     memset(&sin6, 0, sizeof(sin6));
     sin4.sin_family = AF_INET;
     sin4.sin_port = 0;
-    if(makeIPv4sockaddr(str, &sin4)) {
+    if(makeIPv4sockaddr(copy, &sin4)) {
       sin6.sin6_family = AF_INET6;
-      if(makeIPv6sockaddr(str, &sin6) < 0)
-        throw std::runtime_error("Unable to convert presentation address '"+ str +"'"); 
+      if(makeIPv6sockaddr(copy, &sin6) < 0)
+        throw std::runtime_error("Unable to convert presentation address '"+ copy +"'"); 
       
     }
     if(!sin4.sin_port) // 'str' overrides port!
       sin4.sin_port=htons(port);
   }
+
+  /** Parses the same formats as the "human" constructor, without allocating and without
+      calling inet_aton() or getaddrinfo(). Only accepts plain dotted quads for IPv4.
+      Returns an empty optional if \p str could not be parsed. */
+  static std::optional<ComboAddress> parse(std::string_view str, uint16_t port=0);
+
   //! Sets port, deals with htons for you
   void setPort(uint16_t port)
   {
@@ -284,29 +455,122 @@ union ComboAddress {
     return ret;
   }
 
+  //! Maximum length of toChars() and toCharsWithPort() output, including the terminating 0
+  static constexpr size_t maxStringLength = 64;
+
+  /** Writes the human representation of the address to \p buf, as a 0 terminated string.
+      This does not call the resolver and does not allocate, IPv6 is formatted according to RFC 5952.
+      Returns the length of the string, or 0 if \p len was too small. */
+  size_t toChars(char* buf, size_t len) const;
+
+  //! Like toChars(), but includes the port, like 1.2.3.4:80 or [::1]:80
+  size_t toCharsWithPort(char* buf, size_t len) const;
+
   //! Returns a string (human) represntation of the address
   std::string toString() const
   {
-    char host[1024];
-    if(sin4.sin_family && !getnameinfo((struct sockaddr*) this, getSocklen(), host, sizeof(host),0, 0, NI_NUMERICHOST))
-      return host;
-    else
-      return "invalid";
+    char buf[maxStringLength];
+    return std::string(buf, toChars(buf, sizeof(buf)));
   }
 
   //! Returns a string (human) represntation of the address, including port
   std::string toStringWithPort() const
   {
-    if(sin4.sin_family==AF_INET)
-      return toString() + ":" + std::to_string(ntohs(sin4.sin_port));
-    else
-      return "["+toString() + "]:" + std::to_string(ntohs(sin4.sin_port));
+    char buf[maxStringLength];
+    return std::string(buf, toCharsWithPort(buf, sizeof(buf)));
   }
 
   void truncate(unsigned int bits);
 };
 
+/** PackedAddress is a compact, trivially copyable version of ComboAddress, for use in large
+    tables. It holds only the address, family and port, in 20 bytes instead of 28. The address
+    is stored as four 32 bit words in host order, so hashing and comparing work on whole words.
+    Unlike ComboAddress, the ordering is by family, address and then port, so addresses in the
+    same network end up next to each other. Cannot be passed to the kernel, convert to
+    ComboAddress for that.
+*/
+struct PackedAddress
+{
+  PackedAddress() = default;
+
+  explicit PackedAddress(const ComboAddress& ca)
+  {
+    if(ca.sin4.sin_family == AF_INET) {
+      d_words[0] = d_words[1] = d_words[2] = 0;
+      d_words[3] = ntohl(ca.sin4.sin_addr.s_addr);
+      d_ipv6 = false;
+    }
+    else {
+      uint32_t words[4];
+      memcpy(words, &ca.sin6.sin6_addr.s6_addr, sizeof(words));
+      for(int n = 0; n < 4; ++n)
+        d_words[n] = ntohl(words[n]);
+      d_ipv6 = true;
+    }
+    d_port = ntohs(ca.sin4.sin_port);
+  }
 
+  ComboAddress toComboAddress() const
+  {
+    ComboAddress ret;
+    if(!d_ipv6) {
+      ret.sin4.sin_addr.s_addr = htonl(d_words[3]);
+    }
+    else {
+      memset(&ret.sin6, 0, sizeof(ret.sin6));
+      ret.sin6.sin6_family = AF_INET6;
+      uint32_t words[4];
+      for(int n = 0; n < 4; ++n)
+        words[n] = htonl(d_words[n]);
+      memcpy(&ret.sin6.sin6_addr.s6_addr, words, sizeof(words));
+    }
+    ret.sin4.sin_port = htons(d_port);
+    return ret;
+  }
+
+  bool isIPv4() const
+  {
+    return !d_ipv6;
+  }
+  bool isIPv6() const
+  {
+    return d_ipv6;
+  }
+  uint16_t getPort() const
+  {
+    return d_port;
+  }
+
+  bool operator==(const PackedAddress& rhs) const
+  {
+    return d_words[0] == rhs.d_words[0] && d_words[1] == rhs.d_words[1] && d_words[2] == rhs.d_words[2] &&
+      d_words[3] == rhs.d_words[3] && d_port == rhs.d_port && d_ipv6 == rhs.d_ipv6;
+  }
+  bool operator!=(const PackedAddress& rhs) const
+  {
+    return !operator==(rhs);
+  }
+  bool operator<(const PackedAddress& rhs) const
+  {
+    return std::tie(d_ipv6, d_words[0], d_words[1], d_words[2], d_words[3], d_port) <
+      std::tie(rhs.d_ipv6, rhs.d_words[0], rhs.d_words[1], rhs.d_words[2], rhs.d_words[3], rhs.d_port);
+  }
+
+  size_t hash() const
+  {
+    uint64_t hi = ((uint64_t)d_words[0] << 32) | d_words[1];
+    uint64_t lo = ((uint64_t)d_words[2] << 32) | d_words[3];
+    return ComboAddress::mix64(hi ^ ComboAddress::mix64(lo ^ ((uint64_t)d_port << 1) ^ d_ipv6));
+  }
+
+  uint32_t d_words[4]; //!< the address in host order, IPv4 lives in d_words[3]
+  uint16_t d_port;     //!< host order
+  bool d_ipv6;
+};
+
+static_assert(sizeof(PackedAddress) <= 20, "PackedAddress should stay small");
+static_assert(std::is_trivially_copyable<PackedAddress>::value, "PackedAddress should be memcpy-able");
 
 /** This class represents a netmask and can be queried to see if a certain
     IP address is matched by this mask */
@@ -321,6 +585,8 @@ public:
 	d_bits=0;
   }
   
+  friend SIMPLESOCKETS_LITERAL Netmask operator "" _nm(const char* p, size_t l);
+
   explicit Netmask(const ComboAddress& network, uint8_t bits=0xff)
   {
     d_network = network;
@@ -352,11 +618,11 @@ public:
   //! Constructor supplies the mask, which cannot be changed 
   Netmask(const std::string &mask) 
   {
-    auto split=splitField(mask,'/');
-    d_network=ComboAddress(split.first);
+    auto pos = mask.find('/');
+    d_network=ComboAddress(std::string_view(mask).substr(0, pos));
     
-    if(!split.second.empty()) {
-      d_bits = (uint8_t)atoi(split.second.c_str());
+    if(pos != std::string::npos && pos + 1 < mask.size()) {
+      d_bits = (uint8_t)atoi(mask.c_str() + pos + 1);
       if(d_bits<32)
         d_mask=~(0xFFFFFFFF>>d_bits);
       else
@@ -405,6 +671,27 @@ public:
     return false;
   }
 
+  //! If this PackedAddress matches, compares whole words
+  bool match(const PackedAddress& ip) const
+  {
+    if(ip.isIPv6() != isIpv6() || empty())
+      return false;
+    if(!ip.isIPv6())
+      return match4(ip.d_words[3]);
+
+    uint32_t network[4];
+    memcpy(network, &d_network.sin6.sin6_addr.s6_addr, sizeof(network));
+    for(int n = 0; n < 4; ++n) {
+      int bits = d_bits - 32 * n;
+      if(bits <= 0)
+        break;
+      uint32_t mask = bits >= 32 ? 0xFFFFFFFF : ~(0xFFFFFFFF >> bits);
+      if((ip.d_words[n] & mask) != (ntohl(network[n]) & mask))
+        return false;
+    }
+    return true;
+  }
+
   //! If this ASCII IP address matches
   bool match(const std::string &ip) const
   {
@@ -418,9 +705,16 @@ public:
     return (ip & d_mask) == (ntohl(d_network.sin4.sin_addr.s_addr) & d_mask);
   }
 
+  //! Maximum length of toChars() output, including the terminating 0
+  static constexpr size_t maxStringLength = ComboAddress::maxStringLength + 4;
+
+  //! Writes network/bits to \p buf without allocating, returns the length or 0 if \p len was too small
+  size_t toChars(char* buf, size_t len) const;
+
   std::string toString() const
   {
-    return d_network.toString()+"/"+std::to_string((unsigned int)d_bits);
+    char buf[maxStringLength];
+    return std::string(buf, toChars(buf, sizeof(buf)));
   }
 
   std::string toStringNoMask() const
@@ -483,9 +777,88 @@ public:
   }
 
 private:
+  //! for the _nm literal, which can only use constexpr constructors
+  constexpr Netmask(const ComboAddress& network, uint8_t bits, uint32_t mask) : d_network(network), d_mask(mask), d_bits(bits)
+  {}
+
   ComboAddress d_network;
   uint32_t d_mask;
   uint8_t d_bits;
 };
 
+/** User literals that make fully built ComboAddresses and Netmasks, with zero runtime cost when used
+    in constexpr context, in which case malformed literals are a compile error:
+\code{.cpp}
+    constexpr ComboAddress resolver = "[2001:db8::53]:53"_ca;
+    constexpr ComboAddress local = "127.0.0.1:5300"_ca;
+    constexpr ComboAddress any6 = "::"_ipv6;
+    constexpr Netmask internal = "10.0.0.0/8"_nm;
+\endcode
+*/
+
+//! "::1"_ipv6 or "[::1]:53"_ipv6
+SIMPLESOCKETS_LITERAL ComboAddress operator "" _ipv6(const char* p, size_t l)
+{
+  return ComboAddress(parseLiteralIPv6(p, l));
+}
 
+//! "1.2.3.4"_ca, "1.2.3.4:80"_ca, "::1"_ca or "[::1]:53"_ca
+SIMPLESOCKETS_LITERAL ComboAddress operator "" _ca(const char* p, size_t l)
+{
+  size_t colon = literalFind(p, l, ':');
+  if(colon == l || (p[0] != '[' && literalFind(p + colon + 1, l - colon - 1, ':') == l - colon - 1))
+    return ComboAddress(operator "" _ipv4(p, l));
+  return ComboAddress(parseLiteralIPv6(p, l));
+}
+
+//! "10.0.0.0/8"_nm or "2001:db8::/32"_nm, without a /bits, the netmask covers only that address
+SIMPLESOCKETS_LITERAL Netmask operator "" _nm(const char* p, size_t l)
+{
+  size_t slash = literalFind(p, l, '/');
+  bool ipv6 = literalFind(p, slash, ':') != slash;
+  uint32_t bits = ipv6 ? 128 : 32;
+  if(slash != l)
+    bits = parseLiteralNumber(p + slash + 1, l - slash - 1, bits);
+  uint32_t mask = bits < 32 ? ~(0xFFFFFFFF >> bits) : 0xFFFFFFFF;
+
+  if(ipv6) {
+    struct sockaddr_in6 sin6{};
+    sin6.sin6_family = AF_INET6;
+    parseLiteralIPv6Address(p, slash, sin6.sin6_addr.s6_addr);
+    return Netmask(ComboAddress(sin6), bits, mask);
+  }
+  struct sockaddr_in sin4{};
+  sin4.sin_family = AF_INET;
+  sin4.sin_addr.s_addr = chtonl(parseLiteralIPv4Address(p, slash));
+  return Netmask(ComboAddress(sin4), bits, mask);
+}
+
+namespace std {
+  //! Hashes address and port, so ComboAddress can be used in std::unordered_map and friends
+  template<>
+  struct hash<ComboAddress>
+  {
+    size_t operator()(const ComboAddress& ca) const
+    {
+      return ComboAddress::addressPortHash()(ca);
+    }
+  };
+
+  template<>
+  struct hash<PackedAddress>
+  {
+    size_t operator()(const PackedAddress& pa) const
+    {
+      return pa.hash();
+    }
+  };
+
+  template<>
+  struct hash<Netmask>
+  {
+    size_t operator()(const Netmask& nm) const
+    {
+      return nm.getNetwork().hashAddress(nm.getBits());
+    }
+  };
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "comboaddress.hh"
+#include <fmt/format.h>
+#include <fmt/printf.h>
+#include <algorithm>
+
+/** \file comboaddressfmt.hh
+    \brief fmt support for ComboAddress and Netmask
+
+    With this file included, ComboAddress and Netmask can be passed to fmt::format and
+    fmt::sprintf directly. They get written straight into the output buffer, without
+    temporary std::strings:
+\code{.cpp}
+    fmt::format("{} connected", remote);       // 192.0.2.1 connected
+    fmt::format("{:p} connected", remote);     // 192.0.2.1:53 connected, or [2001:db8::1]:53
+    fmt::sprintf("%s connected", remote);      // 192.0.2.1 connected
+    fmt::format("{} is ours", Netmask("192.0.2.0/24"));
+\endcode
+*/
+
+/** Shared formatting code for fmt::formatter and fmt::printf_formatter. 'p' in the format spec means 'with port'.
+    printf has no room for our own format specs, so \p Printf disables parsing. */
+template<typename T, bool Printf=false>
+struct SimpleSocketsFormatter
+{
+  template<typename ParseContext>
+  auto parse(ParseContext& ctx) -> decltype(ctx.begin())
+  {
+    auto iter = ctx.begin();
+    if(!Printf && iter != ctx.end() && *iter == 'p') {
+      d_withPort = true;
+      ++iter;
+    }
+    return iter;
+  }
+
+  template<typename FormatContext>
+  auto format(const T& val, FormatContext& ctx) const -> decltype(ctx.out())
+  {
+    char buf[T::maxStringLength];
+    return std::copy(buf, buf + toChars(val, buf, sizeof(buf)), ctx.out());
+  }
+
+private:
+  size_t toChars(const ComboAddress& ca, char* buf, size_t len) const
+  {
+    return d_withPort ? ca.toCharsWithPort(buf, len) : ca.toChars(buf, len);
+  }
+  size_t toChars(const Netmask& nm, char* buf, size_t len) const
+  {
+    return nm.toChars(buf, len);
+  }
+
+  bool d_withPort{false};
+};
+
+namespace fmt {
+  template<>
+  struct formatter<ComboAddress> : SimpleSocketsFormatter<ComboAddress> {};
+  template<>
+  struct formatter<Netmask> : SimpleSocketsFormatter<Netmask> {};
+
+  // fmt::sprintf has its own extension point, %s never includes the port
+  template<>
+  struct printf_formatter<ComboAddress> : SimpleSocketsFormatter<ComboAddress, true> {};
+  template<>
+  struct printf_formatter<Netmask> : SimpleSocketsFormatter<Netmask, true> {};
+}
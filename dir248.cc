@@ -0,0 +1,92 @@
+#include "dir248.hh"
+#include <algorithm>
+#include <tuple>
+
+Dir248Table::Dir248Table() : d_tbl24(1 << 24, noMatch)
+{
+}
+
+Dir248Table::Dir248Table(const std::vector<std::pair<Netmask, uint16_t>>& entries) : Dir248Table()
+{
+  struct Prefix
+  {
+    int bits;
+    uint32_t network;
+    uint16_t value;
+  };
+  std::vector<Prefix> prefixes;
+  for(const auto& e : entries) {
+    if(!e.first.isIpv4())
+      continue;
+    if(e.second >= noMatch)
+      throw std::runtime_error("Dir248Table values must be below "+std::to_string(noMatch));
+    int bits = std::min(e.first.getBits(), 32);
+    uint32_t mask = bits ? ~0U << (32 - bits) : 0;
+    prefixes.push_back({bits, ntohl(e.first.getNetwork().sin4.sin_addr.s_addr) & mask, e.second});
+  }
+  // shorter prefixes first, so longer ones overwrite them. Stable, so the last duplicate wins
+  std::stable_sort(prefixes.begin(), prefixes.end(), [](const Prefix& a, const Prefix& b) {
+      return a.bits < b.bits;
+    });
+
+  for(const auto& p : prefixes) {
+    if(p.bits <= 24) {
+      auto begin = d_tbl24.begin() + (p.network >> 8);
+      std::fill(begin, begin + (1 << (24 - p.bits)), p.value);
+      continue;
+    }
+    // longer than /24, so we need a second level table for this /24, inheriting what was there
+    uint16_t& entry = d_tbl24[p.network >> 8];
+    if(!(entry & 0x8000)) {
+      size_t group = d_tbl8.size() >> 8;
+      if(group > 0x7fff)
+        throw std::runtime_error("Dir248Table ran out of second level tables");
+      d_tbl8.resize(d_tbl8.size() + 256, entry);
+      entry = 0x8000 | group;
+    }
+    auto begin = d_tbl8.begin() + ((size_t)(entry & 0x7fff) << 8) + (p.network & 0xff);
+    std::fill(begin, begin + (1 << (32 - p.bits)), p.value);
+  }
+}
+
+Dir248::Dir248() : d_table(std::make_shared<Dir248Table>())
+{
+}
+
+// so 10.1.2.3/8 and 10.0.0.0/8 are the same entry
+static Netmask normalize(const Netmask& nm)
+{
+  return Netmask(nm.getMaskedNetwork(), std::min(nm.getBits(), nm.isIpv4() ? 32 : 128));
+}
+
+void Dir248::insert(const Netmask& nm, uint16_t value)
+{
+  if(value >= Dir248Table::noMatch)
+    throw std::runtime_error("Dir248 values must be below "+std::to_string(Dir248Table::noMatch));
+  std::lock_guard<std::mutex> lock(d_writeLock);
+  d_entries[normalize(nm)] = value;
+}
+
+bool Dir248::erase(const Netmask& nm)
+{
+  std::lock_guard<std::mutex> lock(d_writeLock);
+  return d_entries.erase(normalize(nm)) > 0;
+}
+
+void Dir248::commit()
+{
+  std::lock_guard<std::mutex> lock(d_writeLock);
+  auto table = std::make_shared<const Dir248Table>(std::vector<std::pair<Netmask, uint16_t>>(d_entries.begin(), d_entries.end()));
+  {
+    std::lock_guard<std::mutex> tableLock(d_tableLock);
+    d_table.swap(table);
+  }
+  d_generation.fetch_add(1, std::memory_order_release);
+  // 'table' now holds the previous table, which gets freed here unless a Reader still uses it
+}
+
+std::shared_ptr<const Dir248Table> Dir248::getTable() const
+{
+  std::lock_guard<std::mutex> lock(d_tableLock);
+  return d_table;
+}
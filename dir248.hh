@@ -0,0 +1,123 @@
+#pragma once
+#include "comboaddress.hh"
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <stdint.h>
+
+/** \file dir248.hh
+    \brief Constant time IPv4 longest-prefix lookup with lock-free updates
+*/
+
+/** An immutable DIR-24-8 table, mapping IPv4 addresses to small integer values from the most
+    specific matching Netmask. Any lookup takes at most two memory accesses: the top 24 bits index
+    a 16M entry table, which either holds the value, or points to a 256 entry table for the last 8
+    bits. This costs 32MB of memory, plus 512 bytes for each /24 that has longer prefixes in it.
+
+    Values must be below Dir248Table::noMatch. Up to 32768 /24s can have longer prefixes.
+    IPv6 Netmasks are ignored, and IPv6 addresses never match.
+
+    You probably want to use Dir248, which can be updated while in use.
+*/
+class Dir248Table
+{
+public:
+  //! Returned by lookup() if no Netmask matched
+  static constexpr uint16_t noMatch = 0x7fff;
+
+  Dir248Table();
+  explicit Dir248Table(const std::vector<std::pair<Netmask, uint16_t>>& entries);
+
+  //! Looks up an IPv4 address in host byte order
+  uint16_t lookup(uint32_t ip) const
+  {
+    uint16_t entry = d_tbl24[ip >> 8];
+    if(entry & 0x8000)
+      return d_tbl8[((size_t)(entry & 0x7fff) << 8) | (ip & 0xff)];
+    return entry;
+  }
+
+  uint16_t lookup(const ComboAddress& ca) const
+  {
+    if(ca.sin4.sin_family != AF_INET)
+      return noMatch;
+    return lookup(ntohl(ca.sin4.sin_addr.s_addr));
+  }
+
+private:
+  std::vector<uint16_t> d_tbl24;
+  std::vector<uint16_t> d_tbl8;
+};
+
+/** Dir248 holds the Netmasks and values for a Dir248Table, and publishes a new table on commit().
+    Readers keep using the table they have until they pick up the new one, and are never blocked
+    by the (slow) rebuilding of the table. This is RCU-style: an old table gets freed when the last
+    reader lets go of it.
+
+    Readers should each have their own Dir248::Reader, for example one per thread:
+\code{.cpp}
+    Dir248 acl;
+    acl.insert(Netmask("192.0.2.0/24"), 1);
+    acl.commit();
+
+    // in a packet processing thread
+    Dir248::Reader reader(acl);
+    for(;;) {
+      ...
+      if(reader.get().lookup(remote) == 1)
+        ...
+    }
+\endcode
+
+    insert(), erase() and commit() may be called from multiple threads.
+*/
+class Dir248
+{
+public:
+  Dir248();
+
+  //! Stages a Netmask and its value, takes effect on commit()
+  void insert(const Netmask& nm, uint16_t value);
+  //! Stages removal of a Netmask, takes effect on commit(). Returns false if it was not there.
+  bool erase(const Netmask& nm);
+  //! Builds a new table from the staged Netmasks, and makes it available to readers
+  void commit();
+
+  //! The current table. Takes a (very briefly held) lock, Reader avoids that.
+  std::shared_ptr<const Dir248Table> getTable() const;
+
+  //! Caches the current table, only checks an atomic to see if a new one was committed
+  class Reader
+  {
+  public:
+    explicit Reader(const Dir248& source) : d_source(source)
+    {}
+
+    //! Returns the most recently committed table. Cheap, call this for every lookup or batch of lookups.
+    const Dir248Table& get()
+    {
+      uint64_t generation = d_source.d_generation.load(std::memory_order_acquire);
+      if(generation != d_generation) {
+        d_table = d_source.getTable();
+        d_generation = generation;
+      }
+      return *d_table;
+    }
+
+  private:
+    const Dir248& d_source;
+    std::shared_ptr<const Dir248Table> d_table;
+    uint64_t d_generation{std::numeric_limits<uint64_t>::max()};
+  };
+
+private:
+  std::mutex d_writeLock;             // protects d_entries, serializes commits
+  std::map<Netmask, uint16_t> d_entries;
+
+  mutable std::mutex d_tableLock;     // protects d_table
+  std::shared_ptr<const Dir248Table> d_table;
+  std::atomic<uint64_t> d_generation{0};
+};
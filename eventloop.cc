@@ -0,0 +1,206 @@
+#include "eventloop.hh"
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdexcept>
+#include <cmath>
+#include <fmt/format.h>
+#include <fmt/printf.h>
+
+EventLoop::EventLoop(size_t batchSize) : d_events(batchSize ? batchSize : 1)
+{
+  d_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(d_epfd < 0)
+    throw std::runtime_error("Creating epoll instance: "+std::string(strerror(errno)));
+}
+
+EventLoop::~EventLoop()
+{
+  close(d_epfd);
+}
+
+void EventLoop::add(int fd, uint32_t events, Callback callback)
+{
+  if(fd < 0)
+    throw std::runtime_error(fmt::sprintf("Can't add file descriptor %d to EventLoop", fd));
+  if(contains(fd))
+    throw std::runtime_error(fmt::sprintf("File descriptor %d is already in the EventLoop", fd));
+  if((size_t)fd >= d_entries.size())
+    d_entries.resize(fd + 1);
+
+  Entry& entry = d_entries[fd];
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.u64 = ((uint64_t)entry.generation << 32) | (uint32_t)fd;
+  if(epoll_ctl(d_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    throw std::runtime_error(fmt::sprintf("Adding file descriptor %d to EventLoop: %s", fd, strerror(errno)));
+
+  entry.callback = std::make_unique<Callback>(std::move(callback));
+  entry.events = events;
+  entry.active = true;
+  ++d_size;
+}
+
+void EventLoop::modify(int fd, uint32_t events)
+{
+  if(!contains(fd))
+    throw std::runtime_error(fmt::sprintf("File descriptor %d is not in the EventLoop", fd));
+  Entry& entry = d_entries[fd];
+  if(entry.events == events)
+    return;
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.u64 = ((uint64_t)entry.generation << 32) | (uint32_t)fd;
+  if(epoll_ctl(d_epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+    throw std::runtime_error(fmt::sprintf("Modifying file descriptor %d in EventLoop: %s", fd, strerror(errno)));
+  entry.events = events;
+}
+
+void EventLoop::remove(int fd)
+{
+  if(!contains(fd))
+    throw std::runtime_error(fmt::sprintf("File descriptor %d is not in the EventLoop", fd));
+  // EBADF means it was closed already, and epoll forgot about it by itself
+  if(epoll_ctl(d_epfd, EPOLL_CTL_DEL, fd, nullptr) < 0 && errno != EBADF)
+    throw std::runtime_error(fmt::sprintf("Removing file descriptor %d from EventLoop: %s", fd, strerror(errno)));
+
+  Entry& entry = d_entries[fd];
+  for(Deadline* d : {&entry.read, &entry.write, &entry.idle}) {
+    if(d->timer)
+      d_timers.cancel(d->timer);
+    d->timer = 0;
+  }
+  entry.deadlines = false;
+  if(d_dispatching)
+    d_removed.push_back(std::move(entry.callback));
+  entry.callback.reset();
+  entry.events = 0;
+  entry.active = false;
+  ++entry.generation;
+  --d_size;
+}
+
+EventLoop::Deadline& EventLoop::deadline(Entry& entry, uint32_t which)
+{
+  switch(which) {
+  case ReadTimeout:
+    return entry.read;
+  case WriteTimeout:
+    return entry.write;
+  case IdleTimeout:
+    return entry.idle;
+  }
+  throw std::runtime_error(fmt::sprintf("Unknown EventLoop timeout %d", which));
+}
+
+void EventLoop::armDeadline(int fd, uint32_t which, const std::chrono::steady_clock::time_point& when)
+{
+  deadline(d_entries[fd], which).timer = d_timers.arm(when, [this, fd, which]() { deadlineExpired(fd, which); });
+}
+
+void EventLoop::setTimeout(int fd, uint32_t which, double seconds)
+{
+  if(!contains(fd))
+    throw std::runtime_error(fmt::sprintf("File descriptor %d is not in the EventLoop", fd));
+  if(!which || (which & ~(ReadTimeout | WriteTimeout | IdleTimeout)))
+    throw std::runtime_error(fmt::sprintf("Unknown EventLoop timeout %d", which));
+  Entry& entry = d_entries[fd];
+  auto now = std::chrono::steady_clock::now();
+  for(uint32_t bit : {(uint32_t)ReadTimeout, (uint32_t)WriteTimeout, (uint32_t)IdleTimeout}) {
+    if(!(which & bit))
+      continue;
+    Deadline& d = deadline(entry, bit);
+    if(d.timer)
+      d_timers.cancel(d.timer);
+    d.timer = 0;
+    if(seconds >= 0) {
+      d.period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+      d.last = now;
+      armDeadline(fd, bit, d.last + d.period);
+    }
+  }
+  entry.deadlines = entry.read.timer || entry.write.timer || entry.idle.timer;
+}
+
+void EventLoop::deadlineExpired(int fd, uint32_t which)
+{
+  Entry& entry = d_entries[fd];
+  Deadline& d = deadline(entry, which);
+  d.timer = 0;
+  // there was activity since the timer was armed, so the deadline moved, but only now we move the timer
+  auto due = d.last + d.period;
+  if(due > std::chrono::steady_clock::now()) {
+    armDeadline(fd, which, due);
+    return;
+  }
+  entry.deadlines = entry.read.timer || entry.write.timer || entry.idle.timer;
+  Callback* callback = entry.callback.get();
+  (*callback)(fd, which);
+}
+
+size_t EventLoop::runOnce(double timeout)
+{
+  double next = d_timers.nextTimeout();
+  if(next >= 0 && (timeout < 0 || next < timeout))
+    timeout = next;
+  // rounded up, waking up before the first timer expires would be for nothing
+  int res = epoll_wait(d_epfd, &d_events[0], d_events.size(), timeout < 0 ? -1 : (int)std::ceil(timeout * 1000));
+  if(res < 0) {
+    if(errno == EINTR)
+      return 0;
+    throw std::runtime_error("Waiting for events: "+std::string(strerror(errno)));
+  }
+
+  struct Dispatching
+  {
+    explicit Dispatching(EventLoop& loop) : d_loop(loop)
+    {
+      d_loop.d_dispatching = true;
+    }
+    ~Dispatching()
+    {
+      d_loop.d_dispatching = false;
+      d_loop.d_removed.clear();
+    }
+    EventLoop& d_loop;
+  } dispatching(*this);
+
+  // only read the clock if there are deadlines to move
+  std::chrono::steady_clock::time_point now;
+  if(d_timers.size())
+    now = std::chrono::steady_clock::now();
+
+  size_t called = 0;
+  for(int n = 0; n < res; ++n) {
+    int fd = (uint32_t)d_events[n].data.u64;
+    uint32_t generation = d_events[n].data.u64 >> 32;
+    // an earlier callback in this batch may have removed this fd, or even added a new one with the same number
+    if(!contains(fd) || d_entries[fd].generation != generation)
+      continue;
+    Entry& entry = d_entries[fd];
+    uint32_t events = d_events[n].events;
+    if(entry.deadlines) {
+      if(events & EPOLLIN)
+        entry.read.last = now;
+      if(events & EPOLLOUT)
+        entry.write.last = now;
+      entry.idle.last = now;
+    }
+    // not a reference to the entry, a callback that adds fds can resize d_entries
+    Callback* callback = entry.callback.get();
+    (*callback)(fd, events);
+    ++called;
+  }
+  if(d_timers.size())
+    called += d_timers.expire();
+  return called;
+}
+
+void EventLoop::run()
+{
+  d_stop = false;
+  while(!d_stop && (d_size || d_timers.size()))
+    runOnce();
+}
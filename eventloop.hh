@@ -0,0 +1,138 @@
+#pragma once
+#include <sys/epoll.h>
+#include "timerwheel.hh"
+#include <functional>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+/** \file eventloop.hh
+    \brief A persistent epoll based event loop, for servers with many sockets
+*/
+
+/** EventLoop calls a function when a file descriptor becomes readable or writable. Unlike SPoll,
+    interest is registered once and kept by the kernel, so the cost of waiting does not grow with
+    the number of idle file descriptors. Linux only.
+
+    Events are the epoll ones: EPOLLIN, EPOLLOUT, and EPOLLET for edge triggered mode, in which
+    the callback is only called again after new data arrived or new room became available, so it
+    has to read or write until EAGAIN. Without EPOLLET (level triggered) the callback keeps being
+    called as long as the socket is readable or writable. EPOLLERR and EPOLLHUP are always reported.
+
+    Callbacks may add, modify and remove file descriptors, including their own.
+
+    Each fd can have a read, write and idle timeout, see setTimeout(). These live in a TimerWheel,
+    so there can be hundreds of thousands of them, and resetting one on activity costs nothing. For
+    other timers, use timers(), their callbacks are also called from runOnce().
+\code{.cpp}
+    EventLoop loop;
+    loop.add(listener, EPOLLIN, [&](int fd, uint32_t) {
+      SAcceptMany(fd, 64, [&](int client, const ComboAddress& remote) {
+        loop.add(client, EPOLLIN | EPOLLET, [&](int fd, uint32_t events) {
+          if(events & EventLoop::ReadTimeout) {
+            loop.remove(fd);
+            close(fd);
+            return;
+          }
+          ...
+        });
+        loop.setTimeout(client, EventLoop::ReadTimeout, 5);
+      });
+    });
+    loop.run();
+\endcode
+    Not thread safe.
+*/
+class EventLoop
+{
+public:
+  //! Called with the file descriptor and the events that happened
+  typedef std::function<void(int fd, uint32_t events)> Callback;
+
+  //! Passed to the callback as the only event when a timeout set with setTimeout() expires, these bits are not used by epoll
+  enum : uint32_t { ReadTimeout = 1U << 16, WriteTimeout = 1U << 17, IdleTimeout = 1U << 18 };
+
+  //! Up to \p batchSize events are fetched from the kernel per system call
+  explicit EventLoop(size_t batchSize=256);
+  ~EventLoop();
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  //! Start watching \p fd for \p events, calling \p callback when they happen. Adding an fd twice is an exception.
+  void add(int fd, uint32_t events, Callback callback);
+
+  //! Change the events \p fd is watched for, for example to add EPOLLOUT when there is something to write
+  void modify(int fd, uint32_t events);
+
+  //! Stop watching \p fd. Do this before closing it, as epoll keeps watching fds that were dup()'ed.
+  void remove(int fd);
+
+  /** Calls the callback of \p fd with ReadTimeout, WriteTimeout or IdleTimeout, if it is not readable, writable
+      or has no events at all, for \p seconds. Each time it is, the timeout starts over. \p which can be several
+      of these OR'ed together, each expires by itself and the callback gets them one at a time.
+      Once expired, the timeout is not armed again until the next setTimeout(). Negative \p seconds disarms it. */
+  void setTimeout(int fd, uint32_t which, double seconds);
+
+  //! Timers that are not tied to an fd, expired by runOnce()
+  TimerWheel& timers()
+  {
+    return d_timers;
+  }
+
+  //! Is \p fd being watched?
+  bool contains(int fd) const
+  {
+    return fd >= 0 && (size_t)fd < d_entries.size() && d_entries[fd].active;
+  }
+
+  //! Number of file descriptors being watched
+  size_t size() const
+  {
+    return d_size;
+  }
+
+  /** Waits up to \p timeout seconds (negative is infinite) for events, or until the first timer expires, and
+      calls the callbacks for one batch of events and all expired timers. Returns the number of callbacks called,
+      0 on timeout or on a signal. */
+  size_t runOnce(double timeout=-1);
+
+  //! Calls runOnce() until stop() is called, or no file descriptors and timers are left
+  void run();
+
+  //! Makes run() return, after the current batch
+  void stop()
+  {
+    d_stop = true;
+  }
+
+private:
+  struct Deadline
+  {
+    TimerWheel::TimerId timer{0};
+    std::chrono::steady_clock::duration period;
+    std::chrono::steady_clock::time_point last;  // activity, only moves the timer when it expires
+  };
+
+  struct Entry
+  {
+    std::unique_ptr<Callback> callback;  // on the heap, so it stays put while running even if d_entries grows
+    uint32_t events{0};
+    uint32_t generation{0};  // tells events for a removed fd from those for a new fd with the same number
+    bool active{false};
+    bool deadlines{false};   // any of them armed
+    Deadline read, write, idle;
+  };
+
+  Deadline& deadline(Entry& entry, uint32_t which);
+  void armDeadline(int fd, uint32_t which, const std::chrono::steady_clock::time_point& when);
+  void deadlineExpired(int fd, uint32_t which);
+
+  int d_epfd;
+  std::vector<Entry> d_entries;             // indexed by fd
+  std::vector<epoll_event> d_events;
+  std::vector<std::unique_ptr<Callback>> d_removed;  // callbacks removed during a batch, which may still be running
+  TimerWheel d_timers;
+  size_t d_size{0};
+  bool d_dispatching{false};
+  bool d_stop{false};
+};
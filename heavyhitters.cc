@@ -0,0 +1,210 @@
+#include "heavyhitters.hh"
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+SpaceSaving::SpaceSaving(size_t capacity)
+{
+  if(!capacity || capacity >= s_none / 2)
+    throw std::runtime_error("SpaceSaving capacity must be between 1 and "+std::to_string(s_none / 2));
+  d_counters.resize(capacity);
+  // one spare, increment() creates the next bucket before it can free the old one
+  d_buckets.resize(capacity + 1);
+  d_freeBuckets.reserve(d_buckets.size());
+  size_t slots = 1;
+  while(slots < 2 * capacity)
+    slots <<= 1;
+  d_index.resize(slots);
+  // so an attacker can't predict which addresses collide in d_index
+  std::random_device rd;
+  d_seed = ((uint64_t)rd() << 32) | rd();
+  clear();
+}
+
+void SpaceSaving::clear()
+{
+  std::fill(d_index.begin(), d_index.end(), s_none);
+  d_freeBuckets.clear();
+  for(size_t n = d_buckets.size(); n > 0; --n)
+    d_freeBuckets.push_back(n - 1);
+  d_minBucket = s_none;
+  d_used = 0;
+  d_total = 0;
+}
+
+//! The slot holding \p key, or the empty slot where it would go
+size_t SpaceSaving::slotOf(const PackedAddress& key, uint64_t hash) const
+{
+  size_t mask = d_index.size() - 1;
+  size_t slot = hash & mask;
+  for(; d_index[slot] != s_none; slot = (slot + 1) & mask) {
+    const Counter& counter = d_counters[d_index[slot]];
+    if(counter.hash == hash && counter.key == key)
+      break;
+  }
+  return slot;
+}
+
+//! Empties \p slot, and moves later entries of its probe sequence back so they stay findable
+void SpaceSaving::eraseSlot(size_t slot)
+{
+  size_t mask = d_index.size() - 1;
+  size_t hole = slot;
+  for(size_t pos = (hole + 1) & mask; d_index[pos] != s_none; pos = (pos + 1) & mask) {
+    size_t home = d_counters[d_index[pos]].hash & mask;
+    // the entry at 'pos' may only move to 'hole' if 'hole' is not before its home slot
+    if(((pos - home) & mask) >= ((pos - hole) & mask)) {
+      d_index[hole] = d_index[pos];
+      hole = pos;
+    }
+  }
+  d_index[hole] = s_none;
+}
+
+void SpaceSaving::attach(uint32_t c, uint32_t b)
+{
+  Counter& counter = d_counters[c];
+  counter.bucket = b;
+  counter.prev = s_none;
+  counter.next = d_buckets[b].first;
+  if(counter.next != s_none)
+    d_counters[counter.next].prev = c;
+  d_buckets[b].first = c;
+}
+
+void SpaceSaving::detach(uint32_t c)
+{
+  Counter& counter = d_counters[c];
+  if(counter.prev != s_none)
+    d_counters[counter.prev].next = counter.next;
+  else
+    d_buckets[counter.bucket].first = counter.next;
+  if(counter.next != s_none)
+    d_counters[counter.next].prev = counter.prev;
+}
+
+//! Takes a bucket from the free list and links it in after \p b, or at the front if \p b is s_none
+uint32_t SpaceSaving::newBucketAfter(uint32_t b, uint64_t count)
+{
+  uint32_t nb = d_freeBuckets.back();
+  d_freeBuckets.pop_back();
+  Bucket& bucket = d_buckets[nb];
+  bucket.count = count;
+  bucket.first = s_none;
+  bucket.prev = b;
+  bucket.next = b == s_none ? d_minBucket : d_buckets[b].next;
+  if(bucket.next != s_none)
+    d_buckets[bucket.next].prev = nb;
+  if(b == s_none)
+    d_minBucket = nb;
+  else
+    d_buckets[b].next = nb;
+  return nb;
+}
+
+void SpaceSaving::freeBucket(uint32_t b)
+{
+  Bucket& bucket = d_buckets[b];
+  if(bucket.prev != s_none)
+    d_buckets[bucket.prev].next = bucket.next;
+  else
+    d_minBucket = bucket.next;
+  if(bucket.next != s_none)
+    d_buckets[bucket.next].prev = bucket.prev;
+  d_freeBuckets.push_back(b);
+}
+
+void SpaceSaving::increment(uint32_t c)
+{
+  uint32_t b = d_counters[c].bucket;
+  uint64_t count = d_buckets[b].count + 1;
+  uint32_t next = d_buckets[b].next;
+  if(d_buckets[b].first == c && d_counters[c].next == s_none &&
+     (next == s_none || d_buckets[next].count != count)) {
+    // alone in its bucket, and there is no bucket to join, so the bucket itself can move up
+    d_buckets[b].count = count;
+    return;
+  }
+  if(next == s_none || d_buckets[next].count != count)
+    next = newBucketAfter(b, count);
+  detach(c);
+  attach(c, next);
+  if(d_buckets[b].first == s_none)
+    freeBucket(b);
+}
+
+void SpaceSaving::add(const PackedAddress& key)
+{
+  ++d_total;
+  uint64_t hash = hashOf(key);
+  size_t slot = slotOf(key, hash);
+  uint32_t c = d_index[slot];
+  if(c != s_none) {
+    increment(c);
+    return;
+  }
+
+  if(d_used < d_counters.size()) {
+    c = d_used++;
+    d_counters[c].key = key;
+    d_counters[c].hash = hash;
+    d_counters[c].error = 0;
+    d_index[slot] = c;
+    uint32_t b = d_minBucket;
+    if(b == s_none || d_buckets[b].count != 1)
+      b = newBucketAfter(s_none, 1);
+    attach(c, b);
+    return;
+  }
+
+  // all counters in use, so the new key takes over one with the lowest count
+  c = d_buckets[d_minBucket].first;
+  eraseSlot(slotOf(d_counters[c].key, d_counters[c].hash));
+  d_index[slotOf(key, hash)] = c;
+  d_counters[c].key = key;
+  d_counters[c].hash = hash;
+  d_counters[c].error = d_buckets[d_minBucket].count;
+  increment(c);
+}
+
+std::vector<SpaceSaving::Entry> SpaceSaving::top(size_t num) const
+{
+  std::vector<Entry> ret;
+  ret.reserve(d_used);
+  for(size_t c = 0; c < d_used; ++c)
+    ret.push_back({d_counters[c].key, d_buckets[d_counters[c].bucket].count, d_counters[c].error});
+  num = std::min(num, ret.size());
+  std::partial_sort(ret.begin(), ret.begin() + num, ret.end(), [](const Entry& a, const Entry& b) {
+      if(a.count != b.count)
+        return a.count > b.count;
+      return a.key < b.key;
+    });
+  ret.resize(num);
+  return ret;
+}
+
+HeavyHitters::HeavyHitters(const std::vector<std::pair<uint8_t, uint8_t>>& prefixes, size_t capacity)
+{
+  for(const auto& p : prefixes) {
+    if(p.first > 32 || p.second > 128)
+      throw std::runtime_error("HeavyHitters prefix lengths must be at most 32 for IPv4 and 128 for IPv6");
+    d_trackers.push_back({p.first, p.second, SpaceSaving(capacity)});
+  }
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::top(size_t tracker, size_t num) const
+{
+  const Tracker& t = d_trackers.at(tracker);
+  std::vector<Entry> ret;
+  for(const auto& e : t.counters.top(num)) {
+    ComboAddress ca = e.key.toComboAddress();
+    ret.push_back({Netmask(ca, ca.sin4.sin_family == AF_INET ? t.bits4 : t.bits6), e.count, e.error});
+  }
+  return ret;
+}
+
+void HeavyHitters::clear()
+{
+  for(auto& t : d_trackers)
+    t.counters.clear();
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include "comboaddress.hh"
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+/** \file heavyhitters.hh
+    \brief Fixed memory top talker tracking, per address and per prefix
+*/
+
+/** SpaceSaving finds the most frequent keys in a stream using a fixed number of counters, with
+    the Space-Saving algorithm by Metwally, Agrawal and El Abbadi. Any key seen more than
+    total()/capacity times is guaranteed to be tracked. A reported count can be too high,
+    but by no more than the reported error.
+
+    Counters live in buckets of equal count, which are kept in a sorted linked list. Adding a key
+    either moves its counter to the next bucket up, or takes over a counter from the lowest bucket.
+    Both are O(1), and all memory is allocated up front, so add() never allocates.
+
+    Not thread safe.
+*/
+class SpaceSaving
+{
+public:
+  struct Entry
+  {
+    PackedAddress key;
+    uint64_t count;
+    uint64_t error;  //!< count may be this much too high
+  };
+
+  explicit SpaceSaving(size_t capacity);
+
+  //! Counts one occurrence of \p key
+  void add(const PackedAddress& key);
+
+  //! The \p num keys with the highest counts, highest first. Allocates, so don't do this per packet.
+  std::vector<Entry> top(size_t num) const;
+
+  //! Number of keys currently tracked, at most the capacity
+  size_t size() const
+  {
+    return d_used;
+  }
+
+  //! Number of calls to add() since construction or clear()
+  uint64_t total() const
+  {
+    return d_total;
+  }
+
+  void clear();
+
+private:
+  static constexpr uint32_t s_none = 0xffffffff;
+
+  struct Counter
+  {
+    PackedAddress key;
+    uint64_t hash;        // of key, seeded, so d_index can be reorganized without rehashing
+    uint64_t error;
+    uint32_t bucket;
+    uint32_t prev, next;  // other counters in the same bucket
+  };
+
+  struct Bucket
+  {
+    uint64_t count;
+    uint32_t first;       // counters with this count
+    uint32_t prev, next;  // buckets with lower and higher counts
+  };
+
+  uint64_t hashOf(const PackedAddress& key) const
+  {
+    return ComboAddress::mix64(key.hash() ^ d_seed);
+  }
+  size_t slotOf(const PackedAddress& key, uint64_t hash) const;
+  void eraseSlot(size_t slot);
+  void increment(uint32_t c);
+  void attach(uint32_t c, uint32_t b);
+  void detach(uint32_t c);
+  uint32_t newBucketAfter(uint32_t b, uint64_t count);
+  void freeBucket(uint32_t b);
+
+  std::vector<Counter> d_counters;
+  std::vector<Bucket> d_buckets;
+  std::vector<uint32_t> d_freeBuckets;
+  std::vector<uint32_t> d_index;     // open addressing, linear probing, counter numbers or s_none
+  uint64_t d_seed;
+  uint64_t d_total{0};
+  uint32_t d_minBucket{s_none};
+  size_t d_used{0};
+};
+
+/** HeavyHitters tracks top talkers at several prefix lengths at the same time, for example per
+    /24 and /56 and per single address. Each pair of IPv4 and IPv6 prefix lengths gets its own
+    SpaceSaving. Ports are ignored.
+\code{.cpp}
+    HeavyHitters hh({{24, 56}, {32, 128}}, 1000);
+    for(;;) {
+      ...
+      hh.add(remote);
+    }
+    for(const auto& e : hh.top(0, 10))
+      fmt::print("{} sent {} packets\n", e.netmask, e.count);
+\endcode
+    Not thread safe, use one per thread and merge the results when reporting.
+*/
+class HeavyHitters
+{
+public:
+  struct Entry
+  {
+    Netmask netmask;
+    uint64_t count;
+    uint64_t error;  //!< count may be this much too high
+  };
+
+  //! \p prefixes holds pairs of IPv4 and IPv6 prefix lengths, each tracked with \p capacity counters
+  HeavyHitters(const std::vector<std::pair<uint8_t, uint8_t>>& prefixes, size_t capacity);
+
+  //! Counts \p ca in each of the trackers
+  void add(const ComboAddress& ca)
+  {
+    for(auto& t : d_trackers) {
+      ComboAddress prefix(ca);
+      prefix.sin4.sin_port = 0;
+      prefix.truncate(prefix.sin4.sin_family == AF_INET ? t.bits4 : t.bits6);
+      t.counters.add(PackedAddress(prefix));
+    }
+  }
+
+  //! The \p num busiest prefixes for the prefix lengths at position \p tracker of the constructor argument
+  std::vector<Entry> top(size_t tracker, size_t num) const;
+
+  void clear();
+
+private:
+  struct Tracker
+  {
+    uint8_t bits4, bits6;
+    SpaceSaving counters;
+  };
+  std::vector<Tracker> d_trackers;
+};
@@ -0,0 +1,238 @@
+#pragma once
+#include "comboaddress.hh"
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+/** \file intervalindex.hh
+    \brief Read-only index for classifying huge numbers of addresses against huge prefix lists
+*/
+
+/** IntervalIndex maps addresses to the value of the most specific Netmask covering them, like
+    NetmaskTree, but is built once and then only read. This makes it suitable for offline
+    processing of billions of addresses against millions of (overlapping) labeled prefixes, like
+    ASN or geo tables.
+
+    Prefixes get flattened into a sorted array of non-overlapping [start, end] ranges on 128 bit
+    keys, which is searched in Eytzinger (breadth first) order, branch free. lookupBatch() runs
+    many searches in lockstep and prefetches, so memory latency gets overlapped.
+
+    IPv4 is mapped into IPv6 space as ::ffff:0:0/96. This means that ::ffff:1.2.3.4 is the same as
+    1.2.3.4, and that an IPv6 prefix like ::/0 also covers IPv4.
+
+    Use IntervalIndex::Builder to make one:
+\code{.cpp}
+    IntervalIndex<uint32_t>::Builder b;
+    b.add(Netmask("192.0.2.0/24"), 64496);
+    b.add(Netmask("2001:db8::/32"), 64497);
+    auto index = b.build();
+    if(auto asn = index.lookup(ComboAddress("192.0.2.1")))
+      cout << *asn << endl;
+\endcode
+*/
+template<typename T>
+class IntervalIndex
+{
+public:
+  typedef unsigned __int128 Key;
+
+  class Builder
+  {
+  public:
+    //! Adds a prefix, if the same prefix is added again, the last value wins
+    void add(const Netmask& nm, const T& value)
+    {
+      if(nm.empty())
+        throw std::runtime_error("IntervalIndex can't add an empty Netmask");
+      int maxbits = nm.isIpv4() ? 32 : 128;
+      int bits = std::min(nm.getBits(), maxbits) + (nm.isIpv4() ? 96 : 0);
+      Key mask = bits ? ~(Key)0 << (128 - bits) : 0;
+      Entry e;
+      e.start = IntervalIndex::getKey(nm.getNetwork()) & mask;
+      e.end = e.start | ~mask;
+      e.value = d_values.size();
+      d_entries.push_back(e);
+      d_values.push_back(value);
+    }
+
+    //! Flattens the prefixes into an IntervalIndex, leaves the Builder empty
+    IntervalIndex build();
+
+  private:
+    struct Entry
+    {
+      Key start, end;
+      uint32_t value;
+    };
+    std::vector<Entry> d_entries;
+    std::vector<T> d_values;
+  };
+
+  //! Returns the value of the most specific prefix covering \p ca, or nullptr
+  const T* lookup(const ComboAddress& ca) const
+  {
+    Key key = getKey(ca);
+    return getValue(find(key), key);
+  }
+
+  /** Looks up \p num addresses, stores value pointers (or nullptr) in \p results. This is
+      a lot faster than calling lookup() for each address on indexes that do not fit in cache. */
+  void lookupBatch(const ComboAddress* addrs, size_t num, const T** results) const
+  {
+    const size_t group = 16;
+    Key keys[group];
+    size_t pos[group];
+    for(size_t begin = 0; begin < num; begin += group) {
+      size_t count = std::min(group, num - begin);
+      for(size_t n = 0; n < count; ++n) {
+        keys[n] = getKey(addrs[begin + n]);
+        pos[n] = 1;
+      }
+      for(int level = 0; level < d_depth; ++level) {
+        for(size_t n = 0; n < count; ++n) {
+          pos[n] = 2 * pos[n] + (d_tree[pos[n]] <= keys[n]);
+          __builtin_prefetch(&d_tree[std::min(4 * pos[n], d_tree.size() - 1)]);
+        }
+      }
+      for(size_t n = 0; n < count; ++n)
+        results[begin + n] = getValue(rankOf(pos[n]), keys[n]);
+    }
+  }
+
+  //! Number of ranges the prefixes were flattened into
+  size_t size() const
+  {
+    return d_ends.size();
+  }
+
+  bool empty() const
+  {
+    return d_ends.empty();
+  }
+
+  static Key getKey(const ComboAddress& ca)
+  {
+    Key ret = 0;
+    if(ca.sin4.sin_family == AF_INET) {
+      ret = ((Key)0xffff << 32) | ntohl(ca.sin4.sin_addr.s_addr);
+    }
+    else {
+      const uint8_t* p = (const uint8_t*)&ca.sin6.sin6_addr.s6_addr;
+      for(int n = 0; n < 16; ++n)
+        ret = (ret << 8) | p[n];
+    }
+    return ret;
+  }
+
+private:
+  //! Index of the last range starting at or before \p key, or -1
+  ssize_t find(Key key) const
+  {
+    if(d_ends.empty())
+      return -1;
+    size_t pos = 1;
+    for(int level = 0; level < d_depth; ++level) {
+      __builtin_prefetch(&d_tree[std::min(4 * pos, d_tree.size() - 1)]);
+      pos = 2 * pos + (d_tree[pos] <= key);
+    }
+    return rankOf(pos);
+  }
+
+  /* After descending a perfect Eytzinger tree, 'pos' encodes the path taken. Stripping the trailing
+     1 bits plus one leaves the first element greater than the key, whose predecessor we want. */
+  ssize_t rankOf(size_t pos) const
+  {
+    if(d_ends.empty())
+      return -1;
+    pos >>= __builtin_ffsll(~pos);
+    return (ssize_t)d_ranks[pos] - 1;
+  }
+
+  const T* getValue(ssize_t idx, Key key) const
+  {
+    if(idx < 0 || key > d_ends[idx])
+      return nullptr;
+    return &d_values[d_valueIdx[idx]];
+  }
+
+  //! in-order walk over the tree positions, filling them from sorted 'starts'
+  size_t fillTree(const std::vector<Key>& starts, size_t idx, size_t pos)
+  {
+    if(pos >= d_tree.size())
+      return idx;
+    idx = fillTree(starts, idx, 2 * pos);
+    d_tree[pos] = idx < starts.size() ? starts[idx] : ~(Key)0;
+    d_ranks[pos] = std::min(idx, starts.size());
+    idx = fillTree(starts, idx + 1, 2 * pos + 1);
+    return idx;
+  }
+
+  std::vector<Key> d_tree;         // range starts in Eytzinger order, 1-based, padded to a perfect tree
+  std::vector<uint32_t> d_ranks;   // for each tree position, the sorted index of its start
+  std::vector<Key> d_ends;         // sorted order
+  std::vector<uint32_t> d_valueIdx;
+  std::vector<T> d_values;
+  int d_depth{0};
+};
+
+template<typename T>
+IntervalIndex<T> IntervalIndex<T>::Builder::build()
+{
+  // outer prefixes before the inner ones they contain, last added value first for duplicates
+  std::sort(d_entries.begin(), d_entries.end(), [](const Entry& a, const Entry& b) {
+      if(a.start != b.start)
+        return a.start < b.start;
+      if(a.end != b.end)
+        return a.end > b.end;
+      return a.value > b.value;
+    });
+  d_entries.erase(std::unique(d_entries.begin(), d_entries.end(), [](const Entry& a, const Entry& b) {
+        return a.start == b.start && a.end == b.end;
+      }), d_entries.end());
+
+  IntervalIndex ret;
+  std::vector<Key> starts;
+  auto emit = [&](Key from, Key to, uint32_t value) {
+    if(from > to)
+      return;
+    starts.push_back(from);
+    ret.d_ends.push_back(to);
+    ret.d_valueIdx.push_back(value);
+  };
+
+  // prefixes are either nested or disjoint, so a stack of open prefixes tells us who covers what
+  std::vector<const Entry*> open;
+  Key cursor = 0;
+  for(const auto& e : d_entries) {
+    while(!open.empty() && open.back()->end < e.start) {
+      emit(cursor, open.back()->end, open.back()->value);
+      cursor = open.back()->end + 1;
+      open.pop_back();
+    }
+    if(!open.empty() && cursor < e.start)
+      emit(cursor, e.start - 1, open.back()->value);
+    cursor = e.start;
+    open.push_back(&e);
+  }
+  for(; !open.empty(); open.pop_back()) {
+    emit(cursor, open.back()->end, open.back()->value);
+    if(open.back()->end == ~(Key)0)
+      break; // and cursor would wrap
+    cursor = open.back()->end + 1;
+  }
+
+  ret.d_values = std::move(d_values);
+  d_values.clear();
+  d_entries.clear();
+
+  if(!starts.empty()) {
+    ret.d_depth = 1;
+    while(((size_t)1 << ret.d_depth) - 1 < starts.size())
+      ++ret.d_depth;
+    ret.d_tree.resize((size_t)1 << ret.d_depth);
+    ret.d_ranks.resize(ret.d_tree.size());
+    ret.d_ranks[0] = starts.size(); // position 0 means 'nothing greater than the key'
+    ret.fillTree(starts, 0, 1);
+  }
+  return ret;
+}
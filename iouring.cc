@@ -0,0 +1,340 @@
+#include "iouring.hh"
+
+#ifdef HAVE_IOURING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdexcept>
+#include <fmt/format.h>
+#include <fmt/printf.h>
+
+// newer than the headers we may be built with, the kernel says EINVAL if it does not know them, and we try without
+#ifndef IORING_SETUP_COOP_TASKRUN
+#define IORING_SETUP_COOP_TASKRUN (1U << 8)
+#endif
+#ifndef IORING_SETUP_SINGLE_ISSUER
+#define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#endif
+#ifndef IORING_SETUP_DEFER_TASKRUN
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif
+
+static __kernel_timespec toTimespec(double seconds)
+{
+  __kernel_timespec ts;
+  ts.tv_sec = (int64_t)seconds;
+  ts.tv_nsec = (int64_t)((seconds - ts.tv_sec) * 1e9);
+  return ts;
+}
+
+IOUring::IOUring(unsigned int entries)
+{
+  io_uring_params params;
+  // completions get posted when we next wait for them, instead of interrupting us as they happen, if the kernel can
+  for(unsigned int flags : {IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN, IORING_SETUP_COOP_TASKRUN, 0U}) {
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+    d_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(d_fd >= 0 || errno != EINVAL)
+      break;
+  }
+  if(d_fd < 0)
+    throw std::runtime_error("Setting up io_uring: "+std::string(strerror(errno)));
+
+  if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    close(d_fd);
+    throw std::runtime_error("Setting up io_uring: kernel too old, need 5.11 or newer");
+  }
+
+  d_sqEntries = params.sq_entries;
+  d_cqEntries = params.cq_entries;
+  d_ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+                        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  d_ring = mmap(nullptr, d_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_fd, IORING_OFF_SQ_RING);
+  if(d_ring == MAP_FAILED) {
+    int savederrno = errno;
+    close(d_fd);
+    throw std::runtime_error("Mapping io_uring: "+std::string(strerror(savederrno)));
+  }
+  void* sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED) {
+    int savederrno = errno;
+    munmap(d_ring, d_ringSize);
+    close(d_fd);
+    throw std::runtime_error("Mapping io_uring entries: "+std::string(strerror(savederrno)));
+  }
+  d_sqes = (io_uring_sqe*)sqes;
+
+  char* ring = (char*)d_ring;
+  d_sqHead = (unsigned int*)(ring + params.sq_off.head);
+  d_sqTail = (unsigned int*)(ring + params.sq_off.tail);
+  d_sqMask = (unsigned int*)(ring + params.sq_off.ring_mask);
+  d_sqArray = (unsigned int*)(ring + params.sq_off.array);
+  d_cqHead = (unsigned int*)(ring + params.cq_off.head);
+  d_cqTail = (unsigned int*)(ring + params.cq_off.tail);
+  d_cqMask = (unsigned int*)(ring + params.cq_off.ring_mask);
+  d_cqes = (io_uring_cqe*)(ring + params.cq_off.cqes);
+
+  // we fill in the SQEs in ring order, so the indirection array never changes
+  for(unsigned int n = 0; n < d_sqEntries; ++n)
+    d_sqArray[n] = n;
+  d_sqLocalTail = d_sqSubmitted = *d_sqTail;
+}
+
+IOUring::~IOUring()
+{
+  munmap(d_sqes, d_sqEntries * sizeof(io_uring_sqe));
+  munmap(d_ring, d_ringSize);
+  close(d_fd);
+}
+
+int IOUring::enter(unsigned int toSubmit, unsigned int minComplete, const __kernel_timespec* ts)
+{
+  unsigned int flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+  io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if(ts && minComplete) {
+    arg.ts = (uint64_t)ts;
+    flags |= IORING_ENTER_EXT_ARG;
+    return syscall(__NR_io_uring_enter, d_fd, toSubmit, minComplete, flags, &arg, sizeof(arg));
+  }
+  return syscall(__NR_io_uring_enter, d_fd, toSubmit, minComplete, flags, nullptr, _NSIG / 8);
+}
+
+//! Makes sure there is room in the submission ring for \p num more SQEs, submitting what is there if needed
+void IOUring::reserveSQEs(unsigned int num)
+{
+  for(int tries = 0; d_sqLocalTail - __atomic_load_n(d_sqHead, __ATOMIC_ACQUIRE) + num > d_sqEntries; ++tries) {
+    if(tries == 2)
+      throw std::runtime_error("io_uring submission ring stays full");
+    // the kernel refuses new work if completions overflowed, so make room for those first, but their callbacks wait for run()
+    if(tries)
+      takeCompletions();
+    submit();
+  }
+}
+
+io_uring_sqe* IOUring::prepare(uint8_t opcode, int fd, Callback&& callback, double timeout)
+{
+  // an operation and its timeout have to be submitted together, so reserve room for both
+  reserveSQEs(timeout < 0 ? 1 : 2);
+
+  uint32_t idx;
+  if(d_freeOps.empty()) {
+    idx = d_ops.size();
+    d_ops.emplace_back();
+  }
+  else {
+    idx = d_freeOps.back();
+    d_freeOps.pop_back();
+  }
+  Op& op = d_ops[idx];
+  op.callback = std::move(callback);
+  ++d_inFlight;
+
+  io_uring_sqe* sqe = &d_sqes[d_sqLocalTail++ & *d_sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = idx;
+  if(fd >= 0 && (size_t)fd < d_fixedFiles.size() && d_fixedFiles[fd] >= 0) {
+    sqe->fd = d_fixedFiles[fd];
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+
+  if(timeout >= 0) {
+    sqe->flags |= IOSQE_IO_LINK;
+    op.ts = toTimespec(timeout);
+    io_uring_sqe* tsqe = &d_sqes[d_sqLocalTail++ & *d_sqMask];
+    memset(tsqe, 0, sizeof(*tsqe));
+    tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+    tsqe->fd = -1;
+    tsqe->addr = (uint64_t)&op.ts;
+    tsqe->len = 1;
+    tsqe->user_data = s_ignore;
+  }
+  return sqe;
+}
+
+void IOUring::accept(int fd, ComboAddress& remote, int flags, Callback callback, double timeout)
+{
+  io_uring_sqe* sqe = prepare(IORING_OP_ACCEPT, fd, std::move(callback), timeout);
+  Op& op = d_ops[sqe->user_data];
+  op.addrlen = sizeof(remote);
+  sqe->addr = (uint64_t)&remote;
+  sqe->addr2 = (uint64_t)&op.addrlen;
+  sqe->accept_flags = flags;
+}
+
+void IOUring::connect(int fd, const ComboAddress& remote, Callback callback, double timeout)
+{
+  io_uring_sqe* sqe = prepare(IORING_OP_CONNECT, fd, std::move(callback), timeout);
+  Op& op = d_ops[sqe->user_data];
+  op.addr = remote;
+  sqe->addr = (uint64_t)&op.addr;
+  sqe->off = remote.getSocklen();
+}
+
+void IOUring::recv(int fd, void* buf, size_t len, int flags, Callback callback, double timeout)
+{
+  io_uring_sqe* sqe = prepare(IORING_OP_RECV, fd, std::move(callback), timeout);
+  sqe->addr = (uint64_t)buf;
+  sqe->len = len;
+  sqe->msg_flags = flags;
+}
+
+void IOUring::send(int fd, const void* buf, size_t len, int flags, Callback callback, double timeout)
+{
+  io_uring_sqe* sqe = prepare(IORING_OP_SEND, fd, std::move(callback), timeout);
+  sqe->addr = (uint64_t)buf;
+  sqe->len = len;
+  sqe->msg_flags = flags;
+}
+
+void IOUring::recvmsg(int fd, msghdr* msg, int flags, Callback callback, double timeout)
+{
+  io_uring_sqe* sqe = prepare(IORING_OP_RECVMSG, fd, std::move(callback), timeout);
+  sqe->addr = (uint64_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = flags;
+}
+
+void IOUring::sendmsg(int fd, const msghdr* msg, int flags, Callback callback, double timeout)
+{
+  io_uring_sqe* sqe = prepare(IORING_OP_SENDMSG, fd, std::move(callback), timeout);
+  sqe->addr = (uint64_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = flags;
+}
+
+void IOUring::readFixed(int fd, size_t bufIndex, size_t len, Callback callback, double timeout)
+{
+  if(bufIndex >= d_buffers.size() || len > d_buffers[bufIndex].iov_len)
+    throw std::runtime_error(fmt::sprintf("No registered buffer %d with room for %d bytes", bufIndex, len));
+  io_uring_sqe* sqe = prepare(IORING_OP_READ_FIXED, fd, std::move(callback), timeout);
+  sqe->addr = (uint64_t)d_buffers[bufIndex].iov_base;
+  sqe->len = len;
+  sqe->off = (uint64_t)-1;  // the current position, sockets have no other
+  sqe->buf_index = bufIndex;
+}
+
+void IOUring::writeFixed(int fd, size_t bufIndex, size_t len, Callback callback, double timeout)
+{
+  if(bufIndex >= d_buffers.size() || len > d_buffers[bufIndex].iov_len)
+    throw std::runtime_error(fmt::sprintf("No registered buffer %d with room for %d bytes", bufIndex, len));
+  io_uring_sqe* sqe = prepare(IORING_OP_WRITE_FIXED, fd, std::move(callback), timeout);
+  sqe->addr = (uint64_t)d_buffers[bufIndex].iov_base;
+  sqe->len = len;
+  sqe->off = (uint64_t)-1;
+  sqe->buf_index = bufIndex;
+}
+
+void IOUring::timeout(double seconds, Callback callback)
+{
+  io_uring_sqe* sqe = prepare(IORING_OP_TIMEOUT, -1, std::move(callback), -1);
+  Op& op = d_ops[sqe->user_data];
+  op.ts = toTimespec(seconds);
+  sqe->addr = (uint64_t)&op.ts;
+  sqe->len = 1;
+}
+
+void IOUring::registerBuffers(const std::vector<iovec>& buffers)
+{
+  if(!d_buffers.empty())
+    syscall(__NR_io_uring_register, d_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+  d_buffers.clear();
+  if(buffers.empty())
+    return;
+  if(syscall(__NR_io_uring_register, d_fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0)
+    throw std::runtime_error("Registering io_uring buffers: "+std::string(strerror(errno)));
+  d_buffers = buffers;
+}
+
+void IOUring::registerFiles(const std::vector<int>& fds)
+{
+  if(!d_fixedFiles.empty())
+    syscall(__NR_io_uring_register, d_fd, IORING_UNREGISTER_FILES, nullptr, 0);
+  d_fixedFiles.clear();
+  if(fds.empty())
+    return;
+  if(syscall(__NR_io_uring_register, d_fd, IORING_REGISTER_FILES, fds.data(), fds.size()) < 0)
+    throw std::runtime_error("Registering io_uring files: "+std::string(strerror(errno)));
+  for(size_t n = 0; n < fds.size(); ++n) {
+    if(fds[n] < 0)
+      continue;
+    if((size_t)fds[n] >= d_fixedFiles.size())
+      d_fixedFiles.resize(fds[n] + 1, -1);
+    d_fixedFiles[fds[n]] = n;
+  }
+}
+
+size_t IOUring::submit()
+{
+  unsigned int toSubmit = d_sqLocalTail - d_sqSubmitted;
+  if(!toSubmit)
+    return 0;
+  __atomic_store_n(d_sqTail, d_sqLocalTail, __ATOMIC_RELEASE);
+  int res = enter(toSubmit, 0, nullptr);
+  if(res < 0) {
+    // EBUSY and EAGAIN: the kernel is out of room for completions or memory, try again after reaping
+    if(errno == EBUSY || errno == EAGAIN || errno == EINTR)
+      return 0;
+    throw std::runtime_error("Submitting to io_uring: "+std::string(strerror(errno)));
+  }
+  d_sqSubmitted += res;
+  return res;
+}
+
+//! Moves completions from the ring to d_completed, without calling anything
+void IOUring::takeCompletions()
+{
+  unsigned int head = *d_cqHead;
+  for(unsigned int tail = __atomic_load_n(d_cqTail, __ATOMIC_ACQUIRE); head != tail; ++head) {
+    const io_uring_cqe& cqe = d_cqes[head & *d_cqMask];
+    if(cqe.user_data != s_ignore)
+      d_completed.push_back({(uint32_t)cqe.user_data, cqe.res});
+  }
+  __atomic_store_n(d_cqHead, head, __ATOMIC_RELEASE);
+}
+
+//! Calls the callbacks of all completions, without a system call
+size_t IOUring::reap()
+{
+  takeCompletions();
+  size_t called = 0;
+  // callbacks may queue new operations, which can take more completions from the ring
+  while(!d_completed.empty()) {
+    Completion c = d_completed.front();
+    d_completed.pop_front();
+    Callback callback = std::move(d_ops[c.idx].callback);
+    d_freeOps.push_back(c.idx);
+    --d_inFlight;
+    callback(c.res);
+    ++called;
+  }
+  return called;
+}
+
+size_t IOUring::run(double timeout)
+{
+  submit();
+  size_t called = reap();
+  if(called || !d_inFlight)
+    return called;
+
+  unsigned int toSubmit = d_sqLocalTail - d_sqSubmitted;
+  __atomic_store_n(d_sqTail, d_sqLocalTail, __ATOMIC_RELEASE);
+  __kernel_timespec ts = toTimespec(timeout);
+  int res = enter(toSubmit, 1, timeout < 0 ? nullptr : &ts);
+  if(res < 0) {
+    if(errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+      throw std::runtime_error("Waiting for io_uring completions: "+std::string(strerror(errno)));
+  }
+  else
+    d_sqSubmitted += res;
+  return reap();
+}
+#endif
@@ -0,0 +1,131 @@
+#pragma once
+#include "comboaddress.hh"
+
+/** \file iouring.hh
+    \brief Optional io_uring engine for socket operations, build with 'make IOURING=1' or 'meson -Diouring=true'
+*/
+
+#ifdef HAVE_IOURING
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <stdint.h>
+
+/** IOUring queues socket operations to the kernel with io_uring, and calls a function when each is done.
+    Operations are collected in a ring shared with the kernel and submitted together by submit() or run(),
+    and completions are read from another shared ring, so a busy server needs far fewer system calls
+    than with SRead/SWrite and waitForRWData. Linux 5.11 or newer.
+
+    Callbacks get what the system call would have returned, or minus errno, so -EAGAIN and not an
+    exception. Buffers, and the ComboAddress of accept(), have to stay alive until the callback is called.
+    Any operation can have a timeout in seconds, after which it is cancelled and completes with -ECANCELED.
+    Callbacks are only called from run(), never from the functions that queue operations, even when those
+    have to make room in a full ring.
+\code{.cpp}
+    IOUring ring;
+    char buf[512];
+    std::function<void(int)> onRecv = [&](int res) {
+      if(res > 0)
+        ring.send(sock, buf, res, 0, [&](int) { ring.recv(sock, buf, sizeof(buf), 0, onRecv); });
+    };
+    ring.recv(sock, buf, sizeof(buf), 0, onRecv);
+    for(;;)
+      ring.run();
+\endcode
+    If an fd was passed to registerFiles(), operations on it use the registered file, which saves the kernel
+    a lookup per operation. This class has state, and is not thread safe.
+*/
+class IOUring
+{
+public:
+  //! Called with the result of the operation, negative errno on error
+  typedef std::function<void(int res)> Callback;
+
+  //! Room for \p entries operations per submit(). Error = exception, for example on kernels without io_uring.
+  explicit IOUring(unsigned int entries=256);
+  ~IOUring();
+  IOUring(const IOUring&) = delete;
+  IOUring& operator=(const IOUring&) = delete;
+
+  //! Accept a connection on \p fd, and store its address in \p remote. The callback gets the new fd. \p flags like SOCK_NONBLOCK.
+  void accept(int fd, ComboAddress& remote, int flags, Callback callback, double timeout=-1);
+  //! Connect \p fd to \p remote, a blocking socket is fine
+  void connect(int fd, const ComboAddress& remote, Callback callback, double timeout=-1);
+  //! Receive up to \p len bytes into \p buf, the callback gets the number of bytes, 0 on EOF
+  void recv(int fd, void* buf, size_t len, int flags, Callback callback, double timeout=-1);
+  //! Send \p len bytes from \p buf, the callback gets the number of bytes sent, which may be fewer
+  void send(int fd, const void* buf, size_t len, int flags, Callback callback, double timeout=-1);
+  //! Like recvmsg(), \p msg and everything it points to have to stay alive until the callback
+  void recvmsg(int fd, msghdr* msg, int flags, Callback callback, double timeout=-1);
+  //! Like sendmsg(), \p msg and everything it points to have to stay alive until the callback
+  void sendmsg(int fd, const msghdr* msg, int flags, Callback callback, double timeout=-1);
+  //! Read into buffer \p bufIndex of registerBuffers(), which saves the kernel mapping the memory each time
+  void readFixed(int fd, size_t bufIndex, size_t len, Callback callback, double timeout=-1);
+  //! Write \p len bytes from buffer \p bufIndex of registerBuffers()
+  void writeFixed(int fd, size_t bufIndex, size_t len, Callback callback, double timeout=-1);
+  //! Calls the callback with -ETIME after \p seconds
+  void timeout(double seconds, Callback callback);
+
+  //! Register buffers for readFixed() and writeFixed(), replacing earlier ones. Error = exception.
+  void registerBuffers(const std::vector<iovec>& buffers);
+  //! Register file descriptors, replacing earlier ones. Don't close them while registered. Error = exception.
+  void registerFiles(const std::vector<int>& fds);
+
+  //! Pass queued operations to the kernel without waiting for any. Returns how many were submitted.
+  size_t submit();
+
+  /** Submit queued operations, wait up to \p timeout seconds (negative is infinite) for at least one
+      to complete, and call the callbacks of all completed ones. Returns the number of callbacks called. */
+  size_t run(double timeout=-1);
+
+  //! Operations queued or submitted whose callback has not been called yet
+  size_t inFlight() const
+  {
+    return d_inFlight;
+  }
+
+private:
+  static constexpr uint64_t s_ignore = ~0ULL;  // user_data of link timeouts, which have no callback of their own
+
+  struct Op
+  {
+    Callback callback;
+    ComboAddress addr;         // for connect
+    socklen_t addrlen;         // for accept
+    __kernel_timespec ts;      // for timeouts
+  };
+
+  struct Completion
+  {
+    uint32_t idx;
+    int res;
+  };
+
+  void reserveSQEs(unsigned int num);
+  io_uring_sqe* prepare(uint8_t opcode, int fd, Callback&& callback, double timeout);
+  void takeCompletions();
+  size_t reap();
+  int enter(unsigned int toSubmit, unsigned int minComplete, const __kernel_timespec* ts);
+
+  int d_fd;
+  unsigned int d_sqEntries, d_cqEntries;
+  void* d_ring{nullptr};           // both rings, in one mapping
+  size_t d_ringSize;
+  io_uring_sqe* d_sqes{nullptr};
+  unsigned int *d_sqHead, *d_sqTail, *d_sqMask, *d_sqArray;
+  unsigned int *d_cqHead, *d_cqTail, *d_cqMask;
+  io_uring_cqe* d_cqes;
+  unsigned int d_sqLocalTail{0};  // SQEs we filled in, up to here, d_sqTail is what the kernel sees
+  unsigned int d_sqSubmitted{0};  // consumed by the kernel, up to here
+
+  std::deque<Op> d_ops;           // a deque, so the kernel can point into an Op while more are added
+  std::vector<uint32_t> d_freeOps;
+  std::vector<int> d_fixedFiles;  // registered index per fd, or -1
+  std::vector<iovec> d_buffers;
+  std::deque<Completion> d_completed;  // taken from the ring, callback not called yet
+  size_t d_inFlight{0};
+};
+#endif
@@ -0,0 +1,218 @@
+#include "netmaskgroup.hh"
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define NMG_X86 1
+#include <immintrin.h>
+#endif
+
+static uint64_t readBE64(const uint8_t* p)
+{
+  uint64_t ret = 0;
+  for(int n = 0; n < 8; ++n)
+    ret = (ret << 8) | p[n];
+  return ret;
+}
+
+static void getIPv6Words(const ComboAddress& ca, uint64_t& hi, uint64_t& lo)
+{
+  const uint8_t* p = (const uint8_t*)&ca.sin6.sin6_addr.s6_addr;
+  hi = readBE64(p);
+  lo = readBE64(p + 8);
+}
+
+void NetmaskGroup::add(const Netmask& nm)
+{
+  const ComboAddress& network = nm.getNetwork();
+  if(network.sin4.sin_family == AF_INET) {
+    int bits = std::min(nm.getBits(), 32);
+    uint32_t mask = bits ? ~0U << (32 - bits) : 0;
+    d_mask4.push_back(mask);
+    d_net4.push_back(ntohl(network.sin4.sin_addr.s_addr) & mask);
+  }
+  else if(network.sin4.sin_family == AF_INET6) {
+    int bits = std::min(nm.getBits(), 128);
+    uint64_t maskhi = bits >= 64 ? ~0ULL : (bits ? ~0ULL << (64 - bits) : 0);
+    uint64_t masklo = bits >= 128 ? ~0ULL : (bits > 64 ? ~0ULL << (128 - bits) : 0);
+    uint64_t hi, lo;
+    getIPv6Words(network, hi, lo);
+    d_mask6hi.push_back(maskhi);
+    d_mask6lo.push_back(masklo);
+    d_net6hi.push_back(hi & maskhi);
+    d_net6lo.push_back(lo & masklo);
+  }
+  else
+    throw std::runtime_error("NetmaskGroup can't add an empty Netmask");
+}
+
+void NetmaskGroup::clear()
+{
+  d_net4.clear();
+  d_mask4.clear();
+  d_net6hi.clear();
+  d_net6lo.clear();
+  d_mask6hi.clear();
+  d_mask6lo.clear();
+}
+
+static bool match4Scalar(const uint32_t* net, const uint32_t* mask, size_t num, uint32_t ip)
+{
+  for(size_t n = 0; n < num; ++n)
+    if((ip & mask[n]) == net[n])
+      return true;
+  return false;
+}
+
+static bool match6Scalar(const uint64_t* nethi, const uint64_t* netlo, const uint64_t* maskhi, const uint64_t* masklo,
+                         size_t num, uint64_t hi, uint64_t lo)
+{
+  for(size_t n = 0; n < num; ++n)
+    if(((hi & maskhi[n]) == nethi[n]) & ((lo & masklo[n]) == netlo[n]))
+      return true;
+  return false;
+}
+
+#ifdef NMG_X86
+// __builtin_cpu_supports needs __builtin_cpu_init when called before main()
+static bool haveAVX2()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static const bool s_haveAVX2 = haveAVX2();
+
+__attribute__((target("avx2")))
+static bool match4AVX2(const uint32_t* net, const uint32_t* mask, size_t num, uint32_t ip)
+{
+  __m256i addr = _mm256_set1_epi32(ip);
+  size_t n = 0;
+  for(; n + 8 <= num; n += 8) {
+    __m256i m = _mm256_loadu_si256((const __m256i*)(mask + n));
+    __m256i nt = _mm256_loadu_si256((const __m256i*)(net + n));
+    __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(addr, m), nt);
+    if(!_mm256_testz_si256(eq, eq))
+      return true;
+  }
+  return match4Scalar(net + n, mask + n, num - n, ip);
+}
+
+__attribute__((target("avx2")))
+static bool match6AVX2(const uint64_t* nethi, const uint64_t* netlo, const uint64_t* maskhi, const uint64_t* masklo,
+                       size_t num, uint64_t hi, uint64_t lo)
+{
+  __m256i addrhi = _mm256_set1_epi64x(hi);
+  __m256i addrlo = _mm256_set1_epi64x(lo);
+  size_t n = 0;
+  for(; n + 4 <= num; n += 4) {
+    __m256i eqhi = _mm256_cmpeq_epi64(_mm256_and_si256(addrhi, _mm256_loadu_si256((const __m256i*)(maskhi + n))),
+                                      _mm256_loadu_si256((const __m256i*)(nethi + n)));
+    __m256i eqlo = _mm256_cmpeq_epi64(_mm256_and_si256(addrlo, _mm256_loadu_si256((const __m256i*)(masklo + n))),
+                                      _mm256_loadu_si256((const __m256i*)(netlo + n)));
+    if(!_mm256_testz_si256(eqhi, eqlo)) // testz ands its arguments
+      return true;
+  }
+  return match6Scalar(nethi + n, netlo + n, maskhi + n, masklo + n, num - n, hi, lo);
+}
+#endif
+
+#ifdef __SSE2__
+static bool match4SSE2(const uint32_t* net, const uint32_t* mask, size_t num, uint32_t ip)
+{
+  __m128i addr = _mm_set1_epi32(ip);
+  size_t n = 0;
+  for(; n + 4 <= num; n += 4) {
+    __m128i m = _mm_loadu_si128((const __m128i*)(mask + n));
+    __m128i nt = _mm_loadu_si128((const __m128i*)(net + n));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(addr, m), nt)))
+      return true;
+  }
+  return match4Scalar(net + n, mask + n, num - n, ip);
+}
+
+static bool match6SSE2(const uint64_t* nethi, const uint64_t* netlo, const uint64_t* maskhi, const uint64_t* masklo,
+                       size_t num, uint64_t hi, uint64_t lo)
+{
+  __m128i addrhi = _mm_set1_epi64x(hi);
+  __m128i addrlo = _mm_set1_epi64x(lo);
+  size_t n = 0;
+  for(; n + 2 <= num; n += 2) {
+    // SSE2 has no 64 bit compare, so compare 32 bit halves, an entry matches if all 8 bytes of both words do
+    __m128i eqhi = _mm_cmpeq_epi32(_mm_and_si128(addrhi, _mm_loadu_si128((const __m128i*)(maskhi + n))),
+                                   _mm_loadu_si128((const __m128i*)(nethi + n)));
+    __m128i eqlo = _mm_cmpeq_epi32(_mm_and_si128(addrlo, _mm_loadu_si128((const __m128i*)(masklo + n))),
+                                   _mm_loadu_si128((const __m128i*)(netlo + n)));
+    int bits = _mm_movemask_epi8(_mm_and_si128(eqhi, eqlo));
+    if((bits & 0xff) == 0xff || (bits & 0xff00) == 0xff00)
+      return true;
+  }
+  return match6Scalar(nethi + n, netlo + n, maskhi + n, masklo + n, num - n, hi, lo);
+}
+#endif
+
+bool NetmaskGroup::match4(uint32_t ip, size_t begin, size_t end) const
+{
+  const uint32_t* net = d_net4.data() + begin;
+  const uint32_t* mask = d_mask4.data() + begin;
+#ifdef NMG_X86
+  if(s_haveAVX2)
+    return match4AVX2(net, mask, end - begin, ip);
+#endif
+#ifdef __SSE2__
+  return match4SSE2(net, mask, end - begin, ip);
+#else
+  return match4Scalar(net, mask, end - begin, ip);
+#endif
+}
+
+bool NetmaskGroup::match6(uint64_t hi, uint64_t lo, size_t begin, size_t end) const
+{
+#ifdef NMG_X86
+  if(s_haveAVX2)
+    return match6AVX2(d_net6hi.data() + begin, d_net6lo.data() + begin, d_mask6hi.data() + begin, d_mask6lo.data() + begin,
+                      end - begin, hi, lo);
+#endif
+#ifdef __SSE2__
+  return match6SSE2(d_net6hi.data() + begin, d_net6lo.data() + begin, d_mask6hi.data() + begin, d_mask6lo.data() + begin,
+                    end - begin, hi, lo);
+#else
+  return match6Scalar(d_net6hi.data() + begin, d_net6lo.data() + begin, d_mask6hi.data() + begin, d_mask6lo.data() + begin,
+                      end - begin, hi, lo);
+#endif
+}
+
+bool NetmaskGroup::match(const ComboAddress& ca) const
+{
+  if(ca.sin4.sin_family == AF_INET)
+    return match4(ntohl(ca.sin4.sin_addr.s_addr), 0, d_net4.size());
+  if(ca.sin4.sin_family == AF_INET6) {
+    uint64_t hi, lo;
+    getIPv6Words(ca, hi, lo);
+    return match6(hi, lo, 0, d_net6hi.size());
+  }
+  return false;
+}
+
+void NetmaskGroup::matchBatch(const ComboAddress* addrs, size_t num, std::vector<bool>& result) const
+{
+  result.assign(num, false);
+  // walk the tables in blocks so a block stays in cache while we test all addresses against it
+  const size_t block = 4096;
+  for(size_t begin = 0; begin < d_net4.size(); begin += block) {
+    size_t end = std::min(begin + block, d_net4.size());
+    for(size_t n = 0; n < num; ++n) {
+      if(addrs[n].sin4.sin_family == AF_INET && !result[n])
+        result[n] = match4(ntohl(addrs[n].sin4.sin_addr.s_addr), begin, end);
+    }
+  }
+  for(size_t begin = 0; begin < d_net6hi.size(); begin += block) {
+    size_t end = std::min(begin + block, d_net6hi.size());
+    for(size_t n = 0; n < num; ++n) {
+      if(addrs[n].sin4.sin_family == AF_INET6 && !result[n]) {
+        uint64_t hi, lo;
+        getIPv6Words(addrs[n], hi, lo);
+        result[n] = match6(hi, lo, begin, end);
+      }
+    }
+  }
+}
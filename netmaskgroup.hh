@@ -0,0 +1,65 @@
+#pragma once
+#include "comboaddress.hh"
+#include <vector>
+#include <initializer_list>
+#include <stdint.h>
+
+/** \file netmaskgroup.hh
+    \brief Fast 'does any of these Netmasks match' checks
+*/
+
+/** NetmaskGroup answers if an address is matched by any of a set of Netmasks, as needed
+    for example in a packet filter or ACL. Unlike NetmaskTree, it does not tell you which
+    Netmask matched.
+
+    On add(), each Netmask gets compiled into per-family tables of networks and masks
+    (struct of arrays), so match() can compare against many entries at once using AVX2 or
+    SSE2 where available, with a scalar fallback. This makes NetmaskGroup a good fit for
+    small to medium sized sets that are checked very often.
+
+    Like Netmask::match(), IPv4 and IPv6 never match each other.
+*/
+class NetmaskGroup
+{
+public:
+  NetmaskGroup() = default;
+  NetmaskGroup(std::initializer_list<Netmask> netmasks)
+  {
+    for(const auto& nm : netmasks)
+      add(nm);
+  }
+
+  //! Add a Netmask to this group. Empty Netmasks are an exception.
+  void add(const Netmask& nm);
+  //! Add a Netmask in string form, like "192.168.0.0/16"
+  void add(const std::string& nm)
+  {
+    add(Netmask(nm));
+  }
+
+  //! Returns true if any of the Netmasks in this group match \p ca
+  bool match(const ComboAddress& ca) const;
+
+  /** Classifies \p num addresses in one go, for example a whole batch of received datagrams.
+      Sets bit n of \p result if addrs[n] matched, result is resized to \p num. */
+  void matchBatch(const ComboAddress* addrs, size_t num, std::vector<bool>& result) const;
+
+  //! Number of Netmasks in this group
+  size_t size() const
+  {
+    return d_net4.size() + d_net6hi.size();
+  }
+  bool empty() const
+  {
+    return !size();
+  }
+  void clear();
+
+private:
+  bool match4(uint32_t ip, size_t begin, size_t end) const;
+  bool match6(uint64_t hi, uint64_t lo, size_t begin, size_t end) const;
+
+  // all in host byte order, networks are stored pre-masked
+  std::vector<uint32_t> d_net4, d_mask4;
+  std::vector<uint64_t> d_net6hi, d_net6lo, d_mask6hi, d_mask6lo;
+};
@@ -0,0 +1,293 @@
+#pragma once
+#include "comboaddress.hh"
+#include <memory>
+#include <algorithm>
+#include <stdint.h>
+
+/** \file netmasktree.hh
+    \brief Longest-prefix matching of ComboAddresses against many Netmasks
+*/
+
+/** NetmaskTree stores a value per Netmask, and finds the most specific Netmask
+    matching a ComboAddress. It is a path-compressed binary trie, with separate roots
+    for IPv4 and IPv6, so a lookup takes time proportional to the prefix length, and
+    not to the number of entries.
+
+    Like Netmask::match(), IPv4 and IPv6 never match each other, so an IPv4 mapped IPv6
+    address is only matched by IPv6 netmasks.
+
+    Sample code:
+\code{.cpp}
+    NetmaskTree<std::string> nmt;
+    nmt.insert(Netmask("10.0.0.0/8"), "internal");
+    nmt.insert(Netmask("10.1.0.0/16"), "lab");
+    auto f = nmt.lookup(ComboAddress("10.1.2.3")); // f points to "lab"
+\endcode
+
+    T must be default constructible. NetmaskTree is not thread safe.
+*/
+template<typename T>
+class NetmaskTree
+{
+public:
+  NetmaskTree() = default;
+  NetmaskTree(const NetmaskTree&) = delete;
+  NetmaskTree& operator=(const NetmaskTree&) = delete;
+  NetmaskTree(NetmaskTree&&) = default;
+  NetmaskTree& operator=(NetmaskTree&&) = default;
+
+  //! Sets the value for \p nm, replacing any previous value. Returns a reference to the stored value.
+  T& insert(const Netmask& nm, const T& value=T())
+  {
+    Key key;
+    uint8_t bits;
+    getKey(nm, key, bits);
+    std::unique_ptr<Node>* slot = &root(nm.getNetwork());
+    for(;;) {
+      Node* n = slot->get();
+      if(!n) {
+        slot->reset(new Node(key, bits));
+        return setValue(slot->get(), value);
+      }
+      uint8_t common = commonBits(n->key, key, std::min(n->bits, bits));
+      if(common == n->bits) {
+        if(n->bits == bits)
+          return setValue(n, value);
+        slot = &n->child[getBit(key, n->bits)];
+        continue;
+      }
+      // n diverges from our key, or we are a parent of n, need to split
+      std::unique_ptr<Node> split(new Node(mask(key, common), common));
+      split->child[getBit(n->key, common)] = std::move(*slot);
+      *slot = std::move(split);
+      if(common == bits)
+        return setValue(slot->get(), value);
+      Node* leaf = new Node(key, bits);
+      (*slot)->child[getBit(key, common)].reset(leaf);
+      return setValue(leaf, value);
+    }
+  }
+
+  //! Removes \p nm, returns false if it was not present
+  bool erase(const Netmask& nm)
+  {
+    Key key;
+    uint8_t bits;
+    getKey(nm, key, bits);
+    std::unique_ptr<Node>* parent = nullptr;
+    std::unique_ptr<Node>* slot = &root(nm.getNetwork());
+    while(*slot && (*slot)->bits < bits && commonBits((*slot)->key, key, (*slot)->bits) == (*slot)->bits) {
+      parent = slot;
+      slot = &(*slot)->child[getBit(key, (*slot)->bits)];
+    }
+    Node* n = slot->get();
+    if(!n || n->bits != bits || !n->hasValue || commonBits(n->key, key, bits) != bits)
+      return false;
+
+    n->hasValue = false;
+    n->value = T();
+    --d_size;
+    prune(*slot);
+    if(parent)
+      prune(*parent);
+    return true;
+  }
+
+  //! Returns the value of the longest Netmask matching \p ca, or nullptr if there is none
+  const T* lookup(const ComboAddress& ca) const
+  {
+    const Node* n = findBest(ca);
+    return n ? &n->value : nullptr;
+  }
+
+  //! Returns the value of the longest Netmask matching \p ca, or nullptr if there is none
+  T* lookup(const ComboAddress& ca)
+  {
+    const Node* n = findBest(ca);
+    return n ? const_cast<T*>(&n->value) : nullptr;
+  }
+
+  //! Returns the value of the longest Netmask matching \p ca, and that Netmask in \p matched
+  const T* lookup(const ComboAddress& ca, Netmask& matched) const
+  {
+    const Node* n = findBest(ca);
+    if(!n)
+      return nullptr;
+    matched = Netmask(fromKey(n->key, ca.sin4.sin_family), n->bits);
+    return &n->value;
+  }
+
+  //! Returns true if any Netmask in the tree matches \p ca
+  bool match(const ComboAddress& ca) const
+  {
+    return findBest(ca) != nullptr;
+  }
+
+  //! Number of Netmasks stored
+  size_t size() const
+  {
+    return d_size;
+  }
+
+  bool empty() const
+  {
+    return !d_size;
+  }
+
+  void clear()
+  {
+    d_root4.reset();
+    d_root6.reset();
+    d_size = 0;
+  }
+
+private:
+  // address bits in host order, bit 0 is the most significant bit of 'hi'
+  struct Key
+  {
+    uint64_t hi, lo;
+  };
+
+  struct Node
+  {
+    Node(const Key& k, uint8_t b) : key(k), bits(b) {}
+    Key key;
+    uint8_t bits;
+    bool hasValue{false};
+    T value{};
+    std::unique_ptr<Node> child[2];
+  };
+
+  static uint64_t readBE64(const uint8_t* p)
+  {
+    uint64_t ret = 0;
+    for(int n = 0; n < 8; ++n)
+      ret = (ret << 8) | p[n];
+    return ret;
+  }
+
+  static Key getKey(const ComboAddress& ca)
+  {
+    Key ret;
+    if(ca.sin4.sin_family == AF_INET) {
+      ret.hi = ((uint64_t)ntohl(ca.sin4.sin_addr.s_addr)) << 32;
+      ret.lo = 0;
+    }
+    else {
+      const uint8_t* p = (const uint8_t*)&ca.sin6.sin6_addr.s6_addr;
+      ret.hi = readBE64(p);
+      ret.lo = readBE64(p + 8);
+    }
+    return ret;
+  }
+
+  static void getKey(const Netmask& nm, Key& key, uint8_t& bits)
+  {
+    const ComboAddress& network = nm.getNetwork();
+    int maxbits;
+    if(network.sin4.sin_family == AF_INET)
+      maxbits = 32;
+    else if(network.sin4.sin_family == AF_INET6)
+      maxbits = 128;
+    else
+      throw std::runtime_error("NetmaskTree can't store an empty Netmask");
+    bits = std::min(nm.getBits(), maxbits);
+    key = mask(getKey(network), bits);
+  }
+
+  static ComboAddress fromKey(const Key& key, sa_family_t family)
+  {
+    ComboAddress ret;
+    if(family == AF_INET) {
+      ret.sin4.sin_addr.s_addr = htonl((uint32_t)(key.hi >> 32));
+    }
+    else {
+      memset(&ret.sin6, 0, sizeof(ret.sin6));
+      ret.sin6.sin6_family = AF_INET6;
+      uint8_t* p = (uint8_t*)&ret.sin6.sin6_addr.s6_addr;
+      for(int n = 0; n < 8; ++n) {
+        p[n] = key.hi >> (56 - 8*n);
+        p[n + 8] = key.lo >> (56 - 8*n);
+      }
+    }
+    return ret;
+  }
+
+  static Key mask(const Key& key, uint8_t bits)
+  {
+    Key ret;
+    ret.hi = bits >= 64 ? key.hi : (bits ? key.hi & (~0ULL << (64 - bits)) : 0);
+    ret.lo = bits >= 128 ? key.lo : (bits > 64 ? key.lo & (~0ULL << (128 - bits)) : 0);
+    return ret;
+  }
+
+  static int getBit(const Key& key, uint8_t bit)
+  {
+    if(bit < 64)
+      return (key.hi >> (63 - bit)) & 1;
+    return (key.lo >> (127 - bit)) & 1;
+  }
+
+  //! number of leading bits a and b have in common, capped at \p limit
+  static uint8_t commonBits(const Key& a, const Key& b, uint8_t limit)
+  {
+    unsigned int ret;
+    if(uint64_t x = a.hi ^ b.hi)
+      ret = __builtin_clzll(x);
+    else if(uint64_t y = a.lo ^ b.lo)
+      ret = 64 + __builtin_clzll(y);
+    else
+      ret = 128;
+    return ret < limit ? ret : limit;
+  }
+
+  std::unique_ptr<Node>& root(const ComboAddress& ca)
+  {
+    return ca.sin4.sin_family == AF_INET ? d_root4 : d_root6;
+  }
+
+  T& setValue(Node* n, const T& value)
+  {
+    if(!n->hasValue) {
+      n->hasValue = true;
+      ++d_size;
+    }
+    n->value = value;
+    return n->value;
+  }
+
+  //! removes a valueless node from \p slot if it no longer splits two subtrees
+  static void prune(std::unique_ptr<Node>& slot)
+  {
+    Node* n = slot.get();
+    if(!n || n->hasValue || (n->child[0] && n->child[1]))
+      return;
+    std::unique_ptr<Node> child = std::move(n->child[n->child[0] ? 0 : 1]);
+    slot = std::move(child);
+  }
+
+  const Node* findBest(const ComboAddress& ca) const
+  {
+    const Node* n;
+    if(ca.sin4.sin_family == AF_INET)
+      n = d_root4.get();
+    else if(ca.sin4.sin_family == AF_INET6)
+      n = d_root6.get();
+    else
+      return nullptr;
+
+    Key key = getKey(ca);
+    const Node* best = nullptr;
+    while(n && commonBits(n->key, key, n->bits) == n->bits) {
+      if(n->hasValue)
+        best = n;
+      if(n->bits == 128)
+        break;
+      n = n->child[getBit(key, n->bits)].get();
+    }
+    return best;
+  }
+
+  std::unique_ptr<Node> d_root4, d_root6;
+  size_t d_size{0};
+};
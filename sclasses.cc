@@ -3,6 +3,8 @@
 #include <sys/poll.h>
 #include <fmt/format.h>
 #include <fmt/printf.h>
+#include <linux/errqueue.h>
+#include <fcntl.h>
 
 int waitForRWData(int fd, bool waitForRead, double* timeout, bool* error, bool* disconnected)
 {
@@ -133,3 +135,253 @@ void SocketCommunicator::writen(const std::string& content)
   }
     
 }
+
+void SocketCommunicator::writen(std::initializer_list<std::string_view> parts)
+{
+  iovec iov[64];
+  size_t cnt = 0;
+  for(const auto& part : parts) {
+    iov[cnt].iov_base = (void*)part.data();
+    iov[cnt].iov_len = part.size();
+    if(++cnt == sizeof(iov) / sizeof(iov[0])) {
+      writen(iov, cnt);
+      cnt = 0;
+    }
+  }
+  if(cnt)
+    writen(iov, cnt);
+}
+
+void SocketCommunicator::writen(const iovec* iov, size_t iovcnt)
+{
+  size_t total = 0;
+  for(size_t n = 0; n < iovcnt; ++n)
+    total += iov[n].iov_len;
+
+  // SWritenv returns early when the non-blocking socket is full
+  for(size_t pos = SWritenv(d_fd, iov, iovcnt); pos < total; pos = SWritenv(d_fd, iov, iovcnt, pos))
+    waitForRWData(d_fd, false);
+}
+
+ZeroCopySender::ZeroCopySender(int fd) : d_fd(fd)
+{
+  SSetsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, 1);
+}
+
+void ZeroCopySender::send(std::string&& buffer)
+{
+  if(buffer.empty())
+    return;
+  // queued before sending, as completions for the first part can come in while we send the rest
+  d_pending.push_back({std::move(buffer), d_nextId});
+  Pending& p = d_pending.back();
+
+  try {
+    size_t pos = 0;
+    while(pos < p.buffer.size()) {
+      ssize_t res = ::send(d_fd, &p.buffer[pos], p.buffer.size() - pos, MSG_ZEROCOPY);
+      if(res < 0) {
+        if(errno == EAGAIN) {
+          reap();
+          waitForRWData(d_fd, false);
+          continue;
+        }
+        // ENOBUFS means the kernel ran out of memory to track sends, which it gets back as we read completions
+        if(errno == ENOBUFS) {
+          if(!readCompletions())
+            waitForCompletions(-1);
+          continue;
+        }
+        throw std::runtime_error("Zerocopy send to socket: "+std::string(strerror(errno)));
+      }
+      if(res == 0)
+        throw std::runtime_error("EOF on zerocopy send");
+      pos += res;
+      ++d_nextId;
+      ++p.sends;
+    }
+  }
+  catch(...) {
+    // the part that went out is the kernel's until it completes, flush() waits for that as usual, the rest is dropped
+    p.sending = false;
+    if(!p.sends)
+      d_pending.pop_back();
+    throw;
+  }
+  p.sending = false;
+  reap();
+}
+
+void ZeroCopySender::completed(uint32_t lo, uint32_t hi)
+{
+  if(d_pending.empty())
+    return;
+  // the kernel reports 32 bit numbers, which we extend relative to the oldest send in flight
+  uint64_t base = d_pending.front().firstId;
+  uint64_t from = base + (uint32_t)(lo - (uint32_t)base);
+  uint64_t to = from + (uint32_t)(hi - lo);
+
+  for(auto& p : d_pending) {
+    if(p.firstId > to)
+      break;
+    uint64_t last = p.firstId + p.sends - 1;
+    if(!p.sends || last < from)
+      continue;
+    p.completed += std::min(last, to) - std::max(p.firstId, from) + 1;
+    if(p.done())
+      std::string().swap(p.buffer);
+  }
+  while(!d_pending.empty() && d_pending.front().done())
+    d_pending.pop_front();
+}
+
+size_t ZeroCopySender::reap()
+{
+  readCompletions();
+  return d_pending.size();
+}
+
+//! Reads the error queue until it is empty, returns how many messages there were
+size_t ZeroCopySender::readCompletions()
+{
+  size_t messages = 0;
+  for(;;) {
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(recvmsg(d_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      throw std::runtime_error("Reading zerocopy completions: "+std::string(strerror(errno)));
+    }
+    for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if(!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+           (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+        continue;
+      sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      completion(err);
+    }
+    ++messages;
+  }
+  return messages;
+}
+
+void ZeroCopySender::waitForCompletions(double timeout)
+{
+  // with nothing in flight, no completion is coming, so only back off a little
+  bool outstanding = false;
+  for(const auto& p : d_pending)
+    if(p.completed < p.sends)
+      outstanding = true;
+  if(!outstanding && (timeout < 0 || timeout > 0.001))
+    timeout = 0.001;
+  // completions show up as POLLERR, which poll() reports whatever we ask for, so ask for nothing, POLLOUT is nearly always set
+  pollfd pfd{d_fd, 0, 0};
+  if(poll(&pfd, 1, timeout < 0 ? -1 : (int)(timeout * 1000) + 1) < 0 && errno != EINTR)
+    throw std::runtime_error("Waiting for zerocopy completions: "+std::string(strerror(errno)));
+}
+
+bool ZeroCopySender::completion(const sock_extended_err& err)
+{
+  if(err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+    return false;
+  if(err.ee_errno)
+    throw std::runtime_error("Zerocopy completion: "+std::string(strerror(err.ee_errno)));
+  if(err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+    d_copied += err.ee_data - err.ee_info + 1;
+  completed(err.ee_info, err.ee_data);
+  return true;
+}
+
+bool ZeroCopySender::flush(double timeout)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((int64_t)(timeout * 1000000));
+  while(reap()) {
+    double left = -1;
+    if(timeout >= 0) {
+      left = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+      if(left <= 0)
+        return false;
+    }
+    waitForCompletions(left);
+  }
+  return true;
+}
+
+Splicer::Splicer()
+{
+  openPipe();
+}
+
+Splicer::~Splicer()
+{
+  closePipe();
+}
+
+void Splicer::openPipe()
+{
+  if(pipe2(d_pipe, O_CLOEXEC) < 0)
+    throw std::runtime_error("Creating pipe for splicing: "+std::string(strerror(errno)));
+  // a bigger pipe means fewer system calls, but it is fine if we are not allowed one
+  int size = fcntl(d_pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+  if(size < 0)
+    size = fcntl(d_pipe[1], F_GETPIPE_SZ);
+  d_pipeSize = size > 0 ? size : 65536;
+}
+
+void Splicer::closePipe()
+{
+  close(d_pipe[0]);
+  close(d_pipe[1]);
+}
+
+size_t Splicer::transfer(int infd, int outfd, size_t len, double timeout)
+{
+  try {
+    return transferOrThrow(infd, outfd, len, timeout);
+  }
+  catch(...) {
+    // whatever is left in the pipe belongs to no one now
+    closePipe();
+    openPipe();
+    throw;
+  }
+}
+
+size_t Splicer::transferOrThrow(int infd, int outfd, size_t len, double timeout)
+{
+  size_t moved = 0;
+  while(moved < len) {
+    ssize_t res = splice(infd, nullptr, d_pipe[1], nullptr, std::min(len - moved, d_pipeSize), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(res < 0) {
+      if(errno == EAGAIN) {
+        double left = timeout;
+        if(!waitForRWData(infd, true, &left))
+          throw std::runtime_error("Timeout waiting for data to splice");
+        continue;
+      }
+      throw std::runtime_error("Splicing from socket: "+std::string(strerror(errno)));
+    }
+    if(!res)
+      break;
+
+    for(size_t inPipe = res; inPipe; ) {
+      ssize_t out = splice(d_pipe[0], nullptr, outfd, nullptr, inPipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(out < 0) {
+        if(errno == EAGAIN) {
+          double left = timeout;
+          if(!waitForRWData(outfd, false, &left))
+            throw std::runtime_error("Timeout waiting to splice data out");
+          continue;
+        }
+        throw std::runtime_error("Splicing to socket: "+std::string(strerror(errno)));
+      }
+      inPipe -= out;
+    }
+    moved += res;
+  }
+  return moved;
+}
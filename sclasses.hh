@@ -1,6 +1,8 @@
 #pragma once
 #include "swrappers.hh"
 #include <unistd.h>
+#include <initializer_list>
+#include <deque>
 
 int SConnectWithTimeout(int sockfd, const ComboAddress& remote, double timeout);
 
@@ -106,6 +108,12 @@ public:
   //! Fully write out a message, even in the face of partial writes. With timeout.
   void writen(const std::string& message);
 
+  //! Fully write out several buffers as one message, without concatenating them first, like writen({header, body})
+  void writen(std::initializer_list<std::string_view> parts);
+
+  //! Fully write out \p iovcnt buffers as one message
+  void writen(const iovec* iov, size_t iovcnt);
+
   //! Set the timeout (in seconds)
   void setTimeout(double timeout) { d_timeout = timeout; }
 private:
@@ -114,6 +122,105 @@ private:
   double d_timeout{-1};
 };
 
+/** Sends large buffers on a TCP socket with MSG_ZEROCOPY, so the kernel sends straight from our
+    memory instead of copying it first. This saves CPU for buffers of tens of kilobytes and up, for
+    smaller ones the bookkeeping costs more than the copy.
+
+    The kernel reads from a buffer until it reports completion on the socket error queue, so
+    ZeroCopySender keeps the buffers it was given until then. This class has state: the buffers
+    in flight, and which kernel send numbers belong to them. Don't use MSG_ZEROCOPY on the same
+    socket behind its back.
+\code{.cpp}
+    ZeroCopySender zc(sock);
+    zc.send(std::move(bigBuffer));
+    ...
+    zc.flush();  // before closing the socket, wait for the kernel to let go of everything
+\endcode
+*/
+class ZeroCopySender
+{
+public:
+  //! Enables SO_ZEROCOPY on \p fd, throws if the kernel can't do that
+  explicit ZeroCopySender(int fd);
+
+  ZeroCopySender(const ZeroCopySender&) = delete;
+  ZeroCopySender& operator=(const ZeroCopySender&) = delete;
+
+  //! Takes ownership of \p buffer and sends all of it, dealing with partial writes and non-blocking sockets
+  void send(std::string&& buffer);
+
+  //! Processes completions from the error queue and frees finished buffers, does not block. Returns buffers still in flight.
+  size_t reap();
+
+  /** Processes one error queue message that was read by someone else, for example SRecvTxTimestamp() on a socket that
+      also has send timestamps. Returns false if it was not a zerocopy completion. */
+  bool completion(const sock_extended_err& err);
+
+  //! Waits until the kernel is done with all buffers. Returns false on timeout (in seconds, negative is infinite).
+  bool flush(double timeout=-1);
+
+  //! Buffers the kernel still holds on to
+  size_t inFlight() const
+  {
+    return d_pending.size();
+  }
+
+  //! Sends for which the kernel made a copy after all, for example on loopback or without scatter/gather on the NIC
+  uint64_t copiedSends() const
+  {
+    return d_copied;
+  }
+
+private:
+  struct Pending
+  {
+    std::string buffer;
+    uint64_t firstId;          // the send calls for this buffer are numbered from here
+    uint32_t sends{0};
+    uint32_t completed{0};
+    bool sending{true};
+    bool done() const
+    {
+      return !sending && completed == sends;
+    }
+  };
+
+  void completed(uint32_t lo, uint32_t hi);
+  size_t readCompletions();
+  void waitForCompletions(double timeout);
+
+  int d_fd;
+  uint64_t d_nextId{0};        // the kernel numbers each successful MSG_ZEROCOPY send(), from 0
+  uint64_t d_copied{0};
+  std::deque<Pending> d_pending;
+};
+
+/** Moves data from one socket to another through a pipe with splice(), so a proxy never copies
+    the data into user space. Holds on to its pipe, so create one per proxy and reuse it.
+    If transfer() throws, data that was in flight is lost and the pipe is replaced.
+*/
+class Splicer
+{
+public:
+  Splicer();
+  ~Splicer();
+  Splicer(const Splicer&) = delete;
+  Splicer& operator=(const Splicer&) = delete;
+
+  /** Moves up to \p len bytes from \p infd to \p outfd, dealing with partial transfers. On non-blocking
+      sockets, waits up to \p timeout seconds (negative is infinite) each time there is nothing to read
+      or no room to write, like waitForRWData(). Returns the number of bytes moved, which is less than
+      \p len only on EOF of \p infd. Timeout is exception. */
+  size_t transfer(int infd, int outfd, size_t len, double timeout=-1);
+
+private:
+  void openPipe();
+  void closePipe();
+  size_t transferOrThrow(int infd, int outfd, size_t len, double timeout);
+  int d_pipe[2];
+  size_t d_pipeSize;
+};
+
 // returns -1 in case if error, 0 if no data is available, 1 if there is
 // negative time = infinity, timeout is in seconds
 // should, but does not, decrement timeout
@@ -0,0 +1,946 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <algorithm>
+#include <random>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include "swrappers.hh"
+#include "sclasses.hh"
+#include "eventloop.hh"
+#include "timerwheel.hh"
+#include "iouring.hh"
+#include "asyncsockets.hh"
+#include "comboaddressfmt.hh"
+
+/** Benchmarks for the socket wrappers, over loopback. Run as 'sockbench [name...]', without
+    arguments all benchmarks are run. */
+
+static double timeIt(const std::function<void()>& func)
+{
+  auto start = std::chrono::steady_clock::now();
+  func();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+//! CPU time used by this process in nanoseconds, user plus system
+static double cpuTime()
+{
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+}
+
+//! A pair of bound UDP sockets on loopback, with big enough buffers that a burst does not get dropped
+struct UDPPair
+{
+  UDPPair() : sender(AF_INET, SOCK_DGRAM), receiver(AF_INET, SOCK_DGRAM)
+  {
+    SBind(receiver, "127.0.0.1:0"_ipv4);
+    SGetsockname(receiver, receiverAddr);
+    SBind(sender, "127.0.0.1:0"_ipv4);
+    SSetsockopt(receiver, SOL_SOCKET, SO_RCVBUF, 4 * 1024 * 1024);
+  }
+  Socket sender, receiver;
+  ComboAddress receiverAddr{"127.0.0.1"};
+};
+
+//! A connected pair of TCP sockets on loopback, with buffers large enough to hold a whole response
+struct TCPPair
+{
+  TCPPair() : listener(AF_INET, SOCK_STREAM), client(AF_INET, SOCK_STREAM), server(-1)
+  {
+    SBind(listener, "127.0.0.1:0"_ipv4);
+    SListen(listener, 1);
+    ComboAddress addr("127.0.0.1");
+    SGetsockname(listener, addr);
+    SSetsockopt(client, SOL_SOCKET, SO_SNDBUF, 4 * 1024 * 1024);
+    SConnect(client, addr);
+    ComboAddress remote("127.0.0.1");
+    server.d_fd = SAccept(listener, remote);
+    SSetsockopt(server, SOL_SOCKET, SO_RCVBUF, 4 * 1024 * 1024);
+  }
+
+  //! Reads exactly \p bytes from the server side
+  void drain(size_t bytes)
+  {
+    static char buf[65536];
+    while(bytes) {
+      ssize_t res = read(server, buf, std::min(bytes, sizeof(buf)));
+      if(res <= 0)
+        throw std::runtime_error("reading from loopback connection failed");
+      bytes -= res;
+    }
+  }
+
+  Socket listener, client, server;
+};
+
+static void benchMmsg()
+{
+  const unsigned int burst = 64, total = 1000000;
+  for(size_t size : {64, 512, 1400}) {
+    UDPPair p;
+    std::string payload(size, 'x');
+    ComboAddress from;
+    size_t received = 0;
+    double nsec = timeIt([&]() {
+        for(unsigned int n = 0; n < total; n += burst) {
+          for(unsigned int i = 0; i < burst; ++i)
+            SSendto(p.sender, payload, p.receiverAddr);
+          for(unsigned int i = 0; i < burst; ++i)
+            received += SRecvfrom(p.receiver, 1500, from).size();
+        }
+      });
+    if(received != total * size)
+      throw std::runtime_error("lost datagrams on loopback");
+    fmt::printf("%4d bytes, SSendto/SRecvfrom:   %.2f Mpps\n", size, total * 1000.0 / nsec);
+
+    DatagramBatch out(burst, 1500), in(burst, 1500);
+    for(unsigned int i = 0; i < burst; ++i)
+      out.add(payload, p.receiverAddr);
+    nsec = timeIt([&]() {
+        for(unsigned int n = 0; n < total; n += burst) {
+          SSendmmsg(p.sender, out);
+          for(size_t got = 0; got < burst; )
+            got += SRecvmmsg(p.receiver, in);
+        }
+      });
+    fmt::printf("%4d bytes, SSendmmsg/SRecvmmsg: %.2f Mpps\n", size, total * 1000.0 / nsec);
+  }
+}
+
+static void benchGSO()
+{
+  const unsigned int segsize = 1200, burst = 40, total = 1000000;
+  std::string payload(segsize * burst, 'x');
+  static char buf[65536];
+  ComboAddress from;
+
+  auto report = [&](const char* name, const std::function<void(UDPPair&)>& func) {
+    UDPPair p;
+    double cpu = cpuTime();
+    double nsec = timeIt([&]() { func(p); });
+    cpu = cpuTime() - cpu;
+    fmt::printf("%-32s %.2f Mpps, %.0f ns CPU/packet\n", name, total * 1000.0 / nsec, cpu / total);
+  };
+
+  report("SSendto, plain receive:", [&](UDPPair& p) {
+      std::string datagram(segsize, 'x');
+      for(unsigned int n = 0; n < total; n += burst) {
+        for(unsigned int i = 0; i < burst; ++i)
+          SSendto(p.sender, datagram, p.receiverAddr);
+        for(unsigned int i = 0; i < burst; ++i)
+          SRecvfromGRO(p.receiver, buf, sizeof(buf), from);
+      }
+    });
+  report("GSO send, plain receive:", [&](UDPPair& p) {
+      for(unsigned int n = 0; n < total; n += burst) {
+        SSendtoSegmented(p.sender, payload, segsize, p.receiverAddr);
+        for(unsigned int i = 0; i < burst; ++i)
+          SRecvfromGRO(p.receiver, buf, sizeof(buf), from);
+      }
+    });
+  report("GSO send, GRO receive:", [&](UDPPair& p) {
+      SetUDPGRO(p.receiver);
+      for(unsigned int n = 0; n < total; n += burst) {
+        SSendtoSegmented(p.sender, payload, segsize, p.receiverAddr);
+        for(size_t got = 0; got < burst; )
+          got += SRecvfromGRO(p.receiver, buf, sizeof(buf), from).count();
+      }
+    });
+}
+
+static void benchWritev()
+{
+  const unsigned int total = 200000;
+  std::string header(200, 'h'), trailer(20, 't');
+  for(size_t size : {100, 4096, 65536}) {
+    TCPPair p;
+    std::string body(size, 'b');
+    size_t len = header.size() + body.size() + trailer.size();
+    double cpu = cpuTime();
+    double nsec = timeIt([&]() {
+        for(unsigned int n = 0; n < total; ++n) {
+          std::string response = header + body + trailer;
+          SWriten(p.client, response);
+          p.drain(len);
+        }
+      });
+    cpu = cpuTime() - cpu;
+    fmt::printf("%5d byte body, concatenate + SWriten: %.0f ns/response, %.0f ns CPU\n", size, nsec / total, cpu / total);
+
+    cpu = cpuTime();
+    nsec = timeIt([&]() {
+        for(unsigned int n = 0; n < total; ++n) {
+          iovec iov[3] = {{(void*)header.data(), header.size()}, {(void*)body.data(), body.size()}, {(void*)trailer.data(), trailer.size()}};
+          SWritenv(p.client, iov, 3);
+          p.drain(len);
+        }
+      });
+    cpu = cpuTime() - cpu;
+    fmt::printf("%5d byte body, SWritenv:              %.0f ns/response, %.0f ns CPU\n", size, nsec / total, cpu / total);
+  }
+}
+
+//! Forks off a process that reads the server side of \p p until EOF
+static pid_t forkDrainer(TCPPair& p)
+{
+  pid_t pid = fork();
+  if(pid < 0)
+    throw std::runtime_error("fork: "+std::string(strerror(errno)));
+  if(!pid) {
+    static char buf[262144];
+    while(read(p.server, buf, sizeof(buf)) > 0)
+      ;
+    _exit(0);
+  }
+  close(p.server);
+  p.server.release();
+  return pid;
+}
+
+static void benchZeroCopy()
+{
+  const size_t total = 4ULL << 30;
+  for(size_t size : {16384, 262144, 4194304}) {
+    for(bool zerocopy : {false, true}) {
+      TCPPair p;
+      pid_t pid = forkDrainer(p);
+      double cpu = cpuTime();
+      uint64_t copied = 0;
+      double nsec = timeIt([&]() {
+          if(zerocopy) {
+            ZeroCopySender zc(p.client);
+            for(size_t sent = 0; sent < total; sent += size)
+              zc.send(std::string(size, 'x'));
+            zc.flush();
+            copied = zc.copiedSends();
+          }
+          else {
+            for(size_t sent = 0; sent < total; sent += size)
+              SWriten(p.client, std::string(size, 'x'));
+          }
+          shutdown(p.client, SHUT_WR);
+          waitpid(pid, nullptr, 0);
+        });
+      cpu = cpuTime() - cpu;
+      fmt::printf("%7d byte payloads, %-16s %.2f GB/s, %.0f ns sender CPU per 64KB", size, zerocopy ? "ZeroCopySender:" : "SWriten:",
+                  total / nsec, cpu / (total / 65536));
+      if(zerocopy)
+        fmt::printf(", kernel copied %d sends anyway", copied);
+      fmt::printf("\n");
+    }
+  }
+}
+
+//! An unlinked temporary file holding \p size bytes
+static int makeTempFile(size_t size)
+{
+  char name[] = "/tmp/sockbench.XXXXXX";
+  int fd = mkstemp(name);
+  if(fd < 0)
+    throw std::runtime_error("mkstemp: "+std::string(strerror(errno)));
+  unlink(name);
+  SWriten(fd, std::string(size, 'x'));
+  return fd;
+}
+
+static void benchSendfile()
+{
+  const size_t fileSize = 64 * 1024 * 1024, rounds = 32;
+  Socket file(makeTempFile(fileSize));
+
+  for(bool useSendfile : {false, true}) {
+    TCPPair p;
+    pid_t pid = forkDrainer(p);
+    double cpu = cpuTime();
+    double nsec = timeIt([&]() {
+        for(size_t n = 0; n < rounds; ++n) {
+          if(useSendfile) {
+            SSendfile(p.client, file, 0, fileSize);
+          }
+          else {
+            std::string content(fileSize, 0);
+            if(pread(file, &content[0], fileSize, 0) != (ssize_t)fileSize)
+              throw std::runtime_error("short read from file");
+            SWriten(p.client, content);
+          }
+        }
+        shutdown(p.client, SHUT_WR);
+        waitpid(pid, nullptr, 0);
+      });
+    cpu = cpuTime() - cpu;
+    fmt::printf("%-24s %.2f GB/s, %.0f ns sender CPU per MB\n", useSendfile ? "SSendfile:" : "pread + SWriten:",
+                rounds * fileSize / nsec, cpu / (rounds * fileSize / 1048576));
+  }
+}
+
+static void benchSplice()
+{
+  const size_t total = 4ULL << 30;
+  for(bool useSplice : {false, true}) {
+    TCPPair in, out;
+    pid_t drainer = forkDrainer(out);
+    pid_t writer = fork();
+    if(writer < 0)
+      throw std::runtime_error("fork: "+std::string(strerror(errno)));
+    if(!writer) {
+      std::string chunk(1024 * 1024, 'x');
+      for(size_t sent = 0; sent < total; sent += chunk.size())
+        SWriten(in.client, chunk);
+      _exit(0);
+    }
+    close(in.client);
+    in.client.release();
+
+    double cpu = cpuTime();
+    double nsec = timeIt([&]() {
+        if(useSplice) {
+          Splicer splicer;
+          splicer.transfer(in.server, out.client, total);
+        }
+        else {
+          static char buf[65536];
+          for(size_t moved = 0; moved < total; ) {
+            ssize_t res = read(in.server, buf, sizeof(buf));
+            if(res <= 0)
+              throw std::runtime_error("reading from loopback connection failed");
+            SWriten(out.client, std::string(buf, res));
+            moved += res;
+          }
+        }
+        shutdown(out.client, SHUT_WR);
+        waitpid(writer, nullptr, 0);
+        waitpid(drainer, nullptr, 0);
+      });
+    cpu = cpuTime() - cpu;
+    fmt::printf("%-24s %.2f GB/s, %.0f ns proxy CPU per MB\n", useSplice ? "Splicer:" : "read + SWriten:",
+                total / nsec, cpu / (total / 1048576));
+  }
+}
+
+//! How SRead used to work, for comparison
+static std::string readWithSmallBuffer(int sockfd)
+{
+  std::string ret;
+  char buffer[1024];
+  for(;;) {
+    ssize_t res = read(sockfd, buffer, sizeof(buffer));
+    if(res < 0)
+      throw std::runtime_error("Read from socket: "+std::string(strerror(errno)));
+    if(!res)
+      break;
+    ret.append(buffer, res);
+  }
+  return ret;
+}
+
+static void benchSRead()
+{
+  // from a file in the page cache, so we measure the reading side only
+  for(size_t size : {65536, 1048576, 67108864}) {
+    size_t rounds = std::max<size_t>(16, (4ULL << 30) / size / 4);
+    Socket file(makeTempFile(size));
+    const char* names[] = {"1KB reads + append:", "SRead:", "SRead, reused buffer:"};
+    for(int mode = 0; mode < 3; ++mode) {
+      std::string reused;
+      double nsec = timeIt([&]() {
+          for(size_t n = 0; n < rounds; ++n) {
+            lseek(file, 0, SEEK_SET);
+            size_t got;
+            if(mode == 0)
+              got = readWithSmallBuffer(file).size();
+            else if(mode == 1)
+              got = SRead(file).size();
+            else {
+              reused.clear();
+              got = SRead(file, reused);
+            }
+            if(got != size)
+              throw std::runtime_error("short read");
+          }
+        });
+      fmt::printf("%8d bytes, %-24s %.1f us/body, %.2f GB/s\n", size, names[mode], nsec / rounds / 1000, rounds * size / nsec);
+    }
+  }
+}
+
+//! How SRecvfrom used to work, for comparison
+static std::string recvfromZeroFilled(int sockfd, size_t limit, ComboAddress& dest)
+{
+  std::string ret;
+  ret.resize(limit);
+  socklen_t slen = dest.getSocklen();
+  ssize_t res = recvfrom(sockfd, &ret[0], ret.size(), 0, (struct sockaddr*)&dest, &slen);
+  if(res < 0)
+    throw std::runtime_error("Receiving datagram: "+std::string(strerror(errno)));
+  ret.resize(res);
+  return ret;
+}
+
+static void benchRecvfrom()
+{
+  const unsigned int burst = 64, total = 1000000;
+  const size_t limit = 65536;
+  UDPPair p;
+  DatagramBatch out(burst, 1500);
+  for(unsigned int i = 0; i < burst; ++i)
+    out.add(std::string(100, 'x'), p.receiverAddr);
+
+  static char buf[limit];
+  ComboAddress from;
+  const char* names[] = {"resize(64KB) (previous SRecvfrom):", "SRecvfrom, std::string:", "SRecvfrom, caller buffer:"};
+  for(int mode = 0; mode < 3; ++mode) {
+    size_t received = 0;
+    double cpu = cpuTime();
+    double nsec = timeIt([&]() {
+        for(unsigned int n = 0; n < total; n += burst) {
+          SSendmmsg(p.sender, out);
+          for(unsigned int i = 0; i < burst; ++i) {
+            if(mode == 0)
+              received += recvfromZeroFilled(p.receiver, limit, from).size();
+            else if(mode == 1)
+              received += SRecvfrom(p.receiver, limit, from).size();
+            else
+              received += SRecvfrom(p.receiver, buf, sizeof(buf), from);
+          }
+        }
+      });
+    cpu = cpuTime() - cpu;
+    if(received != total * 100)
+      throw std::runtime_error("lost datagrams on loopback");
+    fmt::printf("%-36s %.2f Mpps, %.0f ns CPU/packet\n", names[mode], total * 1000.0 / nsec, cpu / total);
+  }
+}
+
+static void benchAccept()
+{
+  const unsigned int storm = 1000, rounds = 20;
+  Socket listener(AF_INET, SOCK_STREAM);
+  SSetsockopt(listener, SOL_SOCKET, SO_REUSEADDR, 1);
+  SBind(listener, "127.0.0.1:0"_ipv4);
+  SListen(listener, 4096);
+  SetNonBlocking(listener);
+  ComboAddress addr("127.0.0.1");
+  SGetsockname(listener, addr);
+
+  const char* names[] = {"SAccept + SetNonBlocking:", "SAcceptMany:"};
+  for(int mode = 0; mode < 2; ++mode) {
+    double nsec = 0;
+    for(unsigned int r = 0; r < rounds; ++r) {
+      std::vector<int> clients, accepted;
+      for(unsigned int n = 0; n < storm; ++n) {
+        int s = SSocket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK);
+        if(connect(s, (struct sockaddr*)&addr, addr.getSocklen()) < 0 && errno != EINPROGRESS)
+          throw std::runtime_error("connect: "+std::string(strerror(errno)));
+        clients.push_back(s);
+      }
+      nsec += timeIt([&]() {
+          if(mode == 0) {
+            for(;;) {
+              ComboAddress remote;
+              try {
+                int fd = SAccept(listener, remote);
+                SetNonBlocking(fd);
+                accepted.push_back(fd);
+              }
+              catch(std::exception& e) {
+                break;
+              }
+            }
+          }
+          else {
+            SAcceptMany(listener, storm, [&](int fd, const ComboAddress& remote) {
+                accepted.push_back(fd);
+              });
+          }
+        });
+      if(accepted.size() != storm)
+        throw std::runtime_error(fmt::sprintf("accepted %d connections out of %d", accepted.size(), storm));
+      for(int fd : clients)
+        close(fd);
+      for(int fd : accepted)
+        close(fd);
+    }
+    fmt::printf("%-28s %.0f ns/connection\n", names[mode], nsec / (storm * rounds));
+  }
+}
+
+static double nanoseconds(const timespec& ts)
+{
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double realtimeNow()
+{
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return nanoseconds(ts);
+}
+
+//! Prints percentiles of \p latencies, in nanoseconds, and a histogram with power of two buckets
+static void printLatencies(const char* name, std::vector<double>& latencies)
+{
+  std::sort(latencies.begin(), latencies.end());
+  auto pct = [&](double p) { return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
+  fmt::printf("%s %d samples, p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, max %.0f ns\n", name, latencies.size(),
+              pct(0.5), pct(0.99), pct(0.999), latencies.back());
+  std::map<unsigned int, size_t> buckets;
+  for(double l : latencies) {
+    unsigned int bits = 0;
+    for(uint64_t v = l > 0 ? l : 0; v; v >>= 1)
+      ++bits;
+    ++buckets[bits];
+  }
+  for(const auto& b : buckets)
+    fmt::printf("  < %9d ns %7d %s\n", 1ULL << b.first, b.second, std::string(60 * b.second / latencies.size(), '#'));
+}
+
+static void benchTimestamps()
+{
+  const unsigned int total = 20000;
+  UDPPair p;
+  SetTimestamping(p.receiver, true, false);
+  SetTimestamping(p.sender, false, true);
+
+  std::vector<double> latencies;
+  latencies.reserve(total);
+  TxTimestamp tx;
+  for(unsigned int n = 0; n < total; ++n) {
+    double before = realtimeNow();
+    SSendto(p.sender, "ping", p.receiverAddr);
+    while(SRecvTxTimestamp(p.sender, tx))
+      if(tx.type == SCM_TSTAMP_SND)
+        latencies.push_back(nanoseconds(tx.when) - before);
+    ComboAddress from;
+    SRecvfrom(p.receiver, 1500, from);
+  }
+  printLatencies("SSendto to driver:", latencies);
+
+  // a separate process sends, so the receiver really sleeps and has to be woken up
+  pid_t pid = fork();
+  if(pid < 0)
+    throw std::runtime_error("fork: "+std::string(strerror(errno)));
+  if(!pid) {
+    for(unsigned int n = 0; n < total; ++n) {
+      SSendto(p.sender, "ping", p.receiverAddr);
+      usleep(20);
+    }
+    _exit(0);
+  }
+  latencies.clear();
+  char buf[1500];
+  DatagramInfo info;
+  for(unsigned int n = 0; n < total; ++n) {
+    SRecvmsg(p.receiver, buf, sizeof(buf), info);
+    latencies.push_back(realtimeNow() - nanoseconds(info.timestamp));
+  }
+  waitpid(pid, nullptr, 0);
+  printLatencies("kernel receive to SRecvmsg return:", latencies);
+}
+
+static void benchPollSet()
+{
+  const unsigned int total = 200000;
+  for(unsigned int num : {4, 32, 256}) {
+    // one socket stays readable, the others never are
+    std::vector<Socket> sockets;
+    std::vector<int> fds;
+    for(unsigned int n = 0; n < num; ++n) {
+      sockets.emplace_back(AF_INET, SOCK_DGRAM);
+      SBind(sockets.back(), "127.0.0.1:0"_ipv4);
+      fds.push_back(sockets.back());
+    }
+    ComboAddress addr("127.0.0.1");
+    SGetsockname(fds[num / 2], addr);
+    SSendto(fds[0], "x", addr);
+
+    size_t seen = 0;
+    double nsec = timeIt([&]() {
+        for(unsigned int n = 0; n < total; ++n)
+          seen += SPoll(fds, {}, 0).size();
+      });
+    fmt::printf("%3d fds, SPoll:   %.0f ns/call\n", num, nsec / total);
+
+    PollSet ps;
+    for(int fd : fds)
+      ps.add(fd, POLLIN);
+    std::vector<PollSet::Result> results;
+    nsec = timeIt([&]() {
+        for(unsigned int n = 0; n < total; ++n)
+          seen += ps.poll(results, 0);
+      });
+    fmt::printf("%3d fds, PollSet: %.0f ns/call\n", num, nsec / total);
+    if(seen != 2 * total)
+      throw std::runtime_error("poll missed the readable socket");
+  }
+}
+
+#ifdef __cpp_impl_coroutine
+static Task<void> echoMessages(EventLoop& loop, int fd, size_t msgsize, unsigned int rounds)
+{
+  AsyncSocket sock(loop, fd);
+  for(unsigned int r = 0; r < rounds; ++r) {
+    std::string msg;
+    while(msg.size() < msgsize) {
+      std::string part = co_await asyncRead(sock, msgsize - msg.size(), 10);
+      if(part.empty())
+        throw std::runtime_error("EOF in echo request");
+      msg += part;
+    }
+    co_await asyncWriten(sock, msg, 10);
+  }
+}
+#endif
+
+static void benchEcho()
+{
+  const unsigned int conns = 32, rounds = 20000, msgsize = 64, total = conns * rounds;
+
+  auto report = [&](const char* name, const std::function<void(std::vector<int>&)>& serve) {
+    Socket listener(AF_INET, SOCK_STREAM);
+    SBind(listener, "127.0.0.1:0"_ipv4);
+    SListen(listener, conns);
+    ComboAddress addr("127.0.0.1");
+    SGetsockname(listener, addr);
+
+    // the clients live in another process, and send a message on each connection and wait for all answers, over and over
+    pid_t pid = fork();
+    if(pid < 0)
+      throw std::runtime_error("fork: "+std::string(strerror(errno)));
+    if(!pid) {
+      std::vector<int> clients;
+      for(unsigned int n = 0; n < conns; ++n) {
+        clients.push_back(SSocket(AF_INET, SOCK_STREAM));
+        SConnect(clients.back(), addr);
+      }
+      std::string msg(msgsize, 'x');
+      for(unsigned int r = 0; r < rounds; ++r) {
+        for(int fd : clients)
+          SWriten(fd, msg);
+        for(int fd : clients)
+          SReadWithDeadline(fd, msgsize, std::chrono::steady_clock::now() + std::chrono::seconds(10));
+      }
+      _exit(0);
+    }
+
+    std::vector<int> servers;
+    for(unsigned int n = 0; n < conns; ++n) {
+      ComboAddress remote;
+      servers.push_back(SAccept(listener, remote, SOCK_NONBLOCK));
+    }
+    double cpu = cpuTime();
+    double nsec = timeIt([&]() { serve(servers); });
+    cpu = cpuTime() - cpu;
+    waitpid(pid, nullptr, 0);
+    for(int fd : servers)
+      close(fd);
+    fmt::printf("%-26s %.0f ns/message, %.0f ns server CPU/message\n", name, nsec / total, cpu / total);
+  };
+
+  report("waitForRWData + read:", [&](std::vector<int>& servers) {
+      char buf[msgsize];
+      for(unsigned int n = 0; n < total; ++n) {
+        int fd = servers[n % conns];
+        double timeout = 10;
+        if(waitForRWData(fd, true, &timeout) <= 0)
+          throw std::runtime_error("timeout waiting for echo request");
+        if(read(fd, buf, sizeof(buf)) != msgsize)
+          throw std::runtime_error("short echo request");
+        SWriten(fd, std::string(buf, msgsize));
+      }
+    });
+
+#ifdef __cpp_impl_coroutine
+  report("AsyncSocket coroutines:", [&](std::vector<int>& servers) {
+      EventLoop loop;
+      for(int fd : servers)
+        spawn(echoMessages(loop, fd, msgsize, rounds));
+      loop.run();
+    });
+#endif
+
+#ifdef HAVE_IOURING
+  report("IOUring:", [&](std::vector<int>& servers) {
+      IOUring ring;
+      ring.registerFiles(servers);
+      std::vector<std::vector<char>> bufs(conns, std::vector<char>(msgsize));
+      unsigned int echoed = 0;
+      std::function<void(unsigned int)> post = [&](unsigned int c) {
+        ring.recv(servers[c], bufs[c].data(), msgsize, 0, [&, c](int res) {
+            if(res != (int)msgsize)
+              throw std::runtime_error("short echo request");
+            ring.send(servers[c], bufs[c].data(), msgsize, 0, [&, c](int res) {
+                if(res != (int)msgsize)
+                  throw std::runtime_error("short echo response");
+                if(++echoed <= total - conns)
+                  post(c);
+              });
+          });
+      };
+      for(unsigned int c = 0; c < conns; ++c)
+        post(c);
+      while(ring.inFlight())
+        ring.run();
+    });
+#else
+  fmt::printf("IOUring:                   not built, use 'make clean && make IOURING=1'\n");
+#endif
+}
+
+static void benchEventLoop()
+{
+  const unsigned int idle = 10000, active = 100, rounds = 2000;
+  char buf[512];
+
+  Socket listener(AF_INET, SOCK_STREAM);
+  SBind(listener, "127.0.0.1:0"_ipv4);
+  SListen(listener, 4096);
+  ComboAddress addr("127.0.0.1");
+  SGetsockname(listener, addr);
+
+  // the client side of the idle connections lives in another process, so both sides fit in the fd limit
+  int done[2];
+  if(pipe(done) < 0)
+    throw std::runtime_error("pipe: "+std::string(strerror(errno)));
+  pid_t pid = fork();
+  if(pid < 0)
+    throw std::runtime_error("fork: "+std::string(strerror(errno)));
+  if(!pid) {
+    close(done[1]);
+    for(unsigned int n = 0; n < idle; ++n)
+      SConnect(SSocket(AF_INET, SOCK_STREAM), addr);
+    read(done[0], buf, 1);
+    _exit(0);
+  }
+  close(done[0]);
+
+  std::vector<int> clients, servers;
+  for(unsigned int n = 0; n < idle + active; ++n) {
+    ComboAddress remote;
+    if(n % (idle / active + 1) == 0) {
+      clients.push_back(SSocket(AF_INET, SOCK_STREAM));
+      SConnect(clients.back(), addr);
+    }
+    servers.push_back(SAccept(listener, remote, SOCK_NONBLOCK));
+  }
+
+  unsigned int received = 0;
+  auto readAll = [&](int fd) {
+    ssize_t res;
+    while((res = read(fd, buf, sizeof(buf))) > 0)
+      received += res;
+  };
+  auto report = [&](const char* name, const std::function<void()>& waitForAll) {
+    double nsec = 0;
+    for(unsigned int r = 0; r < rounds; ++r) {
+      for(int fd : clients)
+        SWrite(fd, "x");
+      received = 0;
+      // only the waiting and reading is timed, the writes cost the same for all
+      nsec += timeIt([&]() {
+          while(received < active)
+            waitForAll();
+        });
+    }
+    fmt::printf("%-24s %.1f us to find and read %d readable connections out of %d\n", name, nsec / rounds / 1000, active, idle + active);
+  };
+
+  report("SPoll:", [&]() {
+      for(const auto& p : SPoll(servers, {}, 1))
+        readAll(p.first);
+    });
+
+  for(uint32_t mode : {0U, (uint32_t)EPOLLET}) {
+    EventLoop loop;
+    for(int fd : servers)
+      loop.add(fd, EPOLLIN | mode, [&](int fd, uint32_t events) { readAll(fd); });
+    report(mode ? "EventLoop, edge:" : "EventLoop, level:", [&]() { loop.runOnce(1); });
+  }
+
+  for(int fd : clients)
+    close(fd);
+  for(int fd : servers)
+    close(fd);
+  close(done[1]);
+  waitpid(pid, nullptr, 0);
+}
+
+static void benchTimers()
+{
+  const unsigned int total = 1000000;
+  std::mt19937 rng(1);
+  auto now = std::chrono::steady_clock::now();
+  std::vector<std::chrono::steady_clock::time_point> deadlines;
+  for(unsigned int n = 0; n < total; ++n)
+    deadlines.push_back(now + std::chrono::microseconds(rng() % 60000000));
+  std::vector<unsigned int> order(total);
+  for(unsigned int n = 0; n < total; ++n)
+    order[n] = n;
+  std::shuffle(order.begin(), order.end(), rng);
+
+  size_t fired = 0;
+  {
+    std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> timers;
+    std::vector<decltype(timers)::iterator> ids(total);
+    double arm = timeIt([&]() {
+        for(unsigned int n = 0; n < total; ++n)
+          ids[n] = timers.insert({deadlines[n], [&fired]() { ++fired; }});
+      });
+    double cancel = timeIt([&]() {
+        for(unsigned int n : order)
+          timers.erase(ids[n]);
+      });
+    fmt::printf("std::multimap: arm %.0f ns, cancel %.0f ns\n", arm / total, cancel / total);
+  }
+
+  TimerWheel tw;
+  std::vector<TimerWheel::TimerId> ids(total);
+  for(int round = 0; round < 2; ++round) {
+    // the second round reuses the memory of the first
+    double arm = timeIt([&]() {
+        for(unsigned int n = 0; n < total; ++n)
+          ids[n] = tw.arm(deadlines[n], [&fired]() { ++fired; });
+      });
+    double cancel = timeIt([&]() {
+        for(unsigned int n : order)
+          tw.cancel(ids[n]);
+      });
+    fmt::printf("TimerWheel, %s: arm %.0f ns, cancel %.0f ns\n", round ? "reused" : "fresh", arm / total, cancel / total);
+  }
+
+  for(unsigned int n = 0; n < total; ++n)
+    tw.arm(deadlines[n], [&fired]() { ++fired; });
+  double expire = timeIt([&]() {
+      for(auto t = now; t <= now + std::chrono::seconds(61); t += std::chrono::milliseconds(10))
+        tw.expire(t);
+    });
+  if(fired != total)
+    throw std::runtime_error(fmt::sprintf("%d timers fired instead of %d", fired, total));
+  fmt::printf("TimerWheel: expire %.0f ns, over 6100 calls of expire()\n", expire / total);
+}
+
+#ifdef __cpp_impl_coroutine
+static Task<void> echoLines(EventLoop& loop, int fd, unsigned int& served)
+{
+  {
+    AsyncSocket sock(loop, fd);
+    std::string line;
+    while(co_await asyncGetLine(sock, line, 10))
+      co_await asyncWriten(sock, line, 10);
+  }
+  close(fd);
+  ++served;
+}
+
+static Task<void> acceptLines(EventLoop& loop, int listener, unsigned int conns, unsigned int& served, size_t& heap)
+{
+  AsyncSocket sock(loop, listener);
+  for(unsigned int n = 0; n < conns; ++n) {
+    ComboAddress remote("0.0.0.0");
+    int fd = co_await asyncAccept(sock, remote, 10);
+    spawn(echoLines(loop, fd, served));
+  }
+  // all connections are waiting for their first line now
+  heap = mallinfo2().uordblks - heap;
+}
+#endif
+
+static void benchCoroutines()
+{
+#ifdef __cpp_impl_coroutine
+  // the clients need as many fds as the server, and the hard limit here is 20000
+  const unsigned int conns = 9000, rounds = 20;
+  const std::string msg("hello world\n");
+
+  Socket listener(AF_INET, SOCK_STREAM);
+  SBind(listener, "127.0.0.1:0"_ipv4);
+  SListen(listener, 4096);
+  ComboAddress addr("127.0.0.1");
+  SGetsockname(listener, addr);
+
+  pid_t pid = fork();
+  if(pid < 0)
+    throw std::runtime_error("fork: "+std::string(strerror(errno)));
+  if(!pid) {
+    std::vector<int> clients;
+    for(unsigned int n = 0; n < conns; ++n) {
+      clients.push_back(SSocket(AF_INET, SOCK_STREAM));
+      SConnect(clients.back(), addr);
+    }
+    for(unsigned int r = 0; r < rounds; ++r) {
+      for(int fd : clients)
+        SWriten(fd, msg);
+      for(int fd : clients)
+        SReadWithDeadline(fd, msg.size(), std::chrono::steady_clock::now() + std::chrono::seconds(10));
+    }
+    _exit(0);
+  }
+
+  EventLoop loop;
+  unsigned int served = 0;
+  size_t heap = mallinfo2().uordblks;
+  double cpu = cpuTime();
+  double nsec = timeIt([&]() {
+      spawn(acceptLines(loop, listener, conns, served, heap));
+      loop.run();
+    });
+  cpu = cpuTime() - cpu;
+  waitpid(pid, nullptr, 0);
+  if(served != conns)
+    throw std::runtime_error(fmt::sprintf("served %d connections instead of %d", served, conns));
+  fmt::printf("One thread, %d connections: %.0f ms, %.0f ns server CPU/line, %.0f bytes of heap/connection\n",
+              conns, nsec / 1e6, cpu / (conns * rounds), (double)heap / conns);
+#else
+  fmt::printf("coroutines not built, the compiler does not support them\n");
+#endif
+}
+
+int main(int argc, char** argv)
+try
+{
+  std::map<std::string, std::function<void()>> benchmarks{
+    {"accept", benchAccept},
+    {"coroutines", benchCoroutines},
+    {"echo", benchEcho},
+    {"eventloop", benchEventLoop},
+    {"mmsg", benchMmsg},
+    {"pollset", benchPollSet},
+    {"recvfrom", benchRecvfrom},
+    {"gso", benchGSO},
+    {"writev", benchWritev},
+    {"sendfile", benchSendfile},
+    {"sread", benchSRead},
+    {"splice", benchSplice},
+    {"timers", benchTimers},
+    {"timestamps", benchTimestamps},
+    {"zerocopy", benchZeroCopy}
+  };
+
+  std::vector<std::string> names;
+  for(int n = 1; n < argc; ++n)
+    names.push_back(argv[n]);
+  if(names.empty())
+    for(const auto& b : benchmarks)
+      names.push_back(b.first);
+
+  for(const auto& name : names) {
+    auto iter = benchmarks.find(name);
+    if(iter == benchmarks.end()) {
+      std::cerr << "Unknown benchmark '" << name << "'" << std::endl;
+      return EXIT_FAILURE;
+    }
+    fmt::printf("== %s\n", name);
+    iter->second();
+  }
+}
+catch(std::exception& e)
+{
+  std::cerr << "Fatal: " << e.what() << std::endl;
+  return EXIT_FAILURE;
+}
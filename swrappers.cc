@@ -6,6 +6,11 @@
 #include <fmt/format.h>
 #include <fmt/printf.h>
 #include <chrono>
+#include <algorithm>
+#include <netinet/udp.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/net_tstamp.h>
 
 
 /** these functions provide a very lightweight wrapper to the Berkeley sockets API. Errors -> exceptions! */
@@ -46,7 +51,7 @@ int SBind(int sockfd, const ComboAddress& local)
 
 int SAccept(int sockfd, ComboAddress& remote)
 {
-  socklen_t remlen = remote.getSocklen();
+  socklen_t remlen = sizeof(remote);
 
   int ret = accept(sockfd, (struct sockaddr*)&remote, &remlen);
   if(ret < 0)
@@ -54,6 +59,37 @@ int SAccept(int sockfd, ComboAddress& remote)
   return ret;
 }
 
+int SAccept(int sockfd, ComboAddress& remote, int flags)
+{
+  socklen_t remlen = sizeof(remote);
+
+  int ret = accept4(sockfd, (struct sockaddr*)&remote, &remlen, flags);
+  if(ret < 0)
+    RuntimeError(fmt::sprintf("accepting new connection on socket: %s",  strerror(errno)));
+  return ret;
+}
+
+size_t SAcceptMany(int listenfd, size_t max, const std::function<void(int, const ComboAddress&)>& callback, int flags)
+{
+  size_t accepted = 0;
+  ComboAddress remote;
+  while(accepted < max) {
+    socklen_t remlen = sizeof(remote);
+    int fd = accept4(listenfd, (struct sockaddr*)&remote, &remlen, flags);
+    if(fd < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      // the connection went away before we got to it, or a signal came in
+      if(errno == ECONNABORTED || errno == EINTR)
+        continue;
+      RuntimeError(fmt::sprintf("accepting new connections on socket: %s",  strerror(errno)));
+    }
+    ++accepted;
+    callback(fd, remote);
+  }
+  return accepted;
+}
+
 int SListen(int sockfd, int limit)
 {
   int ret = listen(sockfd, limit);
@@ -101,21 +137,103 @@ void SWriten(int sockfd, const std::string& content)
   }
 }
 
-std::string SRead(int sockfd, std::string::size_type limit)
+size_t SWritev(int sockfd, const iovec* iov, size_t iovcnt)
 {
-  std::string ret;
-  char buffer[1024];
-  std::string::size_type leftToRead=limit;
-  for(; leftToRead;) {
-    auto chunk = sizeof(buffer) < leftToRead ? sizeof(buffer) : leftToRead;
-    int res = read(sockfd, buffer, chunk);
+  ssize_t res = writev(sockfd, iov, iovcnt);
+  if(res < 0)
+    RuntimeError(fmt::sprintf("Writev to socket: %s", strerror(errno)));
+  return res;
+}
+
+size_t SWritenv(int sockfd, const iovec* iov, size_t iovcnt, size_t skip)
+{
+  // 'idx' and 'offset' point at the first byte not yet written, past any empty buffers
+  size_t idx = 0, offset = skip, written = skip;
+  auto normalize = [&]() {
+    while(idx < iovcnt && offset >= iov[idx].iov_len) {
+      offset -= iov[idx].iov_len;
+      ++idx;
+    }
+  };
+  normalize();
+
+  iovec chunk[64];
+  while(idx < iovcnt) {
+    size_t cnt = 0;
+    for(; cnt < sizeof(chunk) / sizeof(chunk[0]) && idx + cnt < iovcnt; ++cnt)
+      chunk[cnt] = iov[idx + cnt];
+    chunk[0].iov_base = (char*)chunk[0].iov_base + offset;
+    chunk[0].iov_len -= offset;
+
+    ssize_t res = writev(sockfd, chunk, cnt);
+    if(res < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      RuntimeError(fmt::sprintf("Writev to socket: %s", strerror(errno)));
+    }
+    if(!res)
+      RuntimeError(fmt::sprintf("EOF on writenv"));
+    written += res;
+    offset += res;
+    normalize();
+  }
+  return written;
+}
+
+/* Reads go straight into the newly sized tail of the string. Making room zeroes it, so we try to make no
+   more room than a read will fill. Before the first read, FIONREAD tells us how much is already waiting,
+   so that comes in with one read(). After that, we don't know, so chunks start at 16KB, double each time
+   a read fills its chunk, up to 1MB, and halve when a read fills less than half. */
+static const size_t s_minReadChunk = 16384, s_maxReadChunk = 1048576;
+
+/** Appends at most \p leftToRead bytes to \p buffer with one read(), returns what read() returned.
+    Start with a \p chunk of 0, this updates it for the next call. */
+static ssize_t readAppend(int sockfd, std::string& buffer, size_t leftToRead, size_t& chunk)
+{
+  size_t want = chunk;
+  if(!chunk) {
+    int avail = 0;
+    if(ioctl(sockfd, FIONREAD, &avail) < 0)
+      avail = 0;
+    chunk = s_minReadChunk;
+    want = avail > 0 ? avail : chunk;
+    // room for the next read too, often the one that sees EOF, so it does not move everything we read to grow the string
+    if(avail > 0 && (size_t)avail < leftToRead)
+      buffer.reserve(buffer.size() + avail + chunk);
+  }
+  want = std::min(want, leftToRead);
+
+  size_t oldSize = buffer.size();
+  buffer.resize(oldSize + want);
+  ssize_t res = read(sockfd, &buffer[oldSize], want);
+  buffer.resize(oldSize + std::max<ssize_t>(res, 0));
+  if(want == chunk) {
+    if((size_t)res == chunk)
+      chunk = std::min(2 * chunk, s_maxReadChunk);
+    else if(res >= 0 && (size_t)res < chunk / 2)
+      chunk = std::max(chunk / 2, s_minReadChunk);
+  }
+  return res;
+}
+
+size_t SRead(int sockfd, std::string& buffer, std::string::size_type limit)
+{
+  size_t chunk = 0, leftToRead = limit;
+  while(leftToRead) {
+    ssize_t res = readAppend(sockfd, buffer, leftToRead, chunk);
     if(res < 0)
       RuntimeError(fmt::sprintf("Read from socket: %s", strerror(errno)));
     if(!res)
       break;
-    ret.append(buffer, res);
     leftToRead -= res;
   }
+  return limit - leftToRead;
+}
+
+std::string SRead(int sockfd, std::string::size_type limit)
+{
+  std::string ret;
+  SRead(sockfd, ret, limit);
   return ret;
 }
 
@@ -137,19 +255,416 @@ int SSend(int sockfd, const std::string& content, int flags)
 
 std::string SRecvfrom(int sockfd, std::string::size_type limit, ComboAddress& dest, int flags)
 {
+  /* Like readAppend(), the datagram goes straight into the string, and making room zeroes it. On a datagram
+     socket FIONREAD is the length of the next datagram, so we make exactly enough room. If none is waiting
+     yet, we make room for the largest there can be. Another thread reading the same socket can take the
+     datagram we measured first though, and if the next one is longer, it is cut short as if over \p limit. */
+  int next = 0;
+  if(ioctl(sockfd, FIONREAD, &next) < 0 || next < 0)
+    next = 0;
   std::string ret;
-  ret.resize(limit);
-  
-  socklen_t slen = dest.getSocklen();
-  int res = recvfrom(sockfd, &ret[0], ret.size(), flags, (struct sockaddr*)&dest, &slen);
-  
+  ret.resize(std::min<size_t>(limit, next ? next : 65536));
+  ret.resize(SRecvfrom(sockfd, &ret[0], ret.size(), dest, flags & ~MSG_TRUNC));
+  return ret;
+}
+
+size_t SRecvfrom(int sockfd, char* buf, size_t len, ComboAddress& dest, int flags)
+{
+  socklen_t slen = sizeof(dest);
+  ssize_t res = recvfrom(sockfd, buf, len, flags, (struct sockaddr*)&dest, &slen);
   if(res < 0)
     RuntimeError(fmt::sprintf("Receiving datagram with SRecvfrom: %s", strerror(errno)));
-    
-  ret.resize(res);
+  return res;
+}
+
+void SetRecvPktInfo(int sockfd)
+{
+  int one = 1;
+  // IP_PKTINFO also covers IPv4 on dual stack sockets, IPV6_RECVPKTINFO fails on IPv4 sockets
+  int v4 = setsockopt(sockfd, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one));
+  int v6 = setsockopt(sockfd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+  if(v4 < 0 && v6 < 0)
+    RuntimeError(fmt::sprintf("Enabling packet info on socket: %s", strerror(errno)));
+}
+
+size_t SRecvmsg(int sockfd, char* buf, size_t len, DatagramInfo& info, int flags)
+{
+  iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+
+  // room for both packet infos, as a dual stack socket can have either, and for both kinds of timestamp.
+  // CMSG_FIRSTHDR() hands out cmsghdr pointers into this, so it must be aligned like one
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(in_pktinfo)) + CMSG_SPACE(sizeof(in6_pktinfo)) +
+               CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(scm_timestamping))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &info.source;
+  msg.msg_namelen = sizeof(info.source);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t res = recvmsg(sockfd, &msg, flags);
+  if(res < 0)
+    RuntimeError(fmt::sprintf("Receiving datagram with SRecvmsg: %s", strerror(errno)));
+
+  info.destination = ComboAddress();
+  info.ifindex = 0;
+  info.truncated = msg.msg_flags & MSG_TRUNC;
+  info.timestamp = {0, 0};
+  for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+      in_pktinfo pi;
+      memcpy(&pi, CMSG_DATA(cmsg), sizeof(pi));
+      info.destination.sin4.sin_addr = pi.ipi_addr;
+      info.ifindex = pi.ipi_ifindex;
+    }
+    else if(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+      in6_pktinfo pi;
+      memcpy(&pi, CMSG_DATA(cmsg), sizeof(pi));
+      memset(&info.destination.sin6, 0, sizeof(info.destination.sin6));
+      info.destination.sin6.sin6_family = AF_INET6;
+      info.destination.sin6.sin6_addr = pi.ipi6_addr;
+      info.ifindex = pi.ipi6_ifindex;
+    }
+    else if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(&info.timestamp, CMSG_DATA(cmsg), sizeof(info.timestamp));
+    }
+    else if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      scm_timestamping tss;
+      memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+      info.timestamp = tss.ts[0];  // software, ts[2] would be hardware
+    }
+  }
+  return res;
+}
+
+void SSendmsg(int sockfd, std::string_view content, const ComboAddress& dest, const ComboAddress& source, int ifindex, int flags)
+{
+  iovec iov;
+  iov.iov_base = (void*)content.data();
+  iov.iov_len = content.size();
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(in6_pktinfo))];
+  memset(control, 0, sizeof(control));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void*)&dest;
+  msg.msg_namelen = dest.getSocklen();
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+
+  cmsghdr* cmsg = (cmsghdr*)control;
+  if(source.sin4.sin_family == AF_INET) {
+    // also works for IPv4 mapped destinations on a dual stack socket
+    in_pktinfo pi;
+    memset(&pi, 0, sizeof(pi));
+    pi.ipi_spec_dst = source.sin4.sin_addr;
+    pi.ipi_ifindex = ifindex;
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(pi));
+    memcpy(CMSG_DATA(cmsg), &pi, sizeof(pi));
+    msg.msg_controllen = CMSG_SPACE(sizeof(pi));
+  }
+  else {
+    in6_pktinfo pi;
+    memset(&pi, 0, sizeof(pi));
+    pi.ipi6_addr = source.sin6.sin6_addr;
+    pi.ipi6_ifindex = ifindex;
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(pi));
+    memcpy(CMSG_DATA(cmsg), &pi, sizeof(pi));
+    msg.msg_controllen = CMSG_SPACE(sizeof(pi));
+  }
+
+  if(sendmsg(sockfd, &msg, flags) < 0)
+    RuntimeError(fmt::sprintf("Sending datagram with SSendmsg from %s to %s: %s", source.toString(), dest.toStringWithPort(), strerror(errno)));
+}
+
+void SetTimestampNS(int sockfd, bool to)
+{
+  int val = to;
+  if(setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val)) < 0)
+    RuntimeError(fmt::sprintf("Setting SO_TIMESTAMPNS on socket: %s", strerror(errno)));
+}
+
+void SetTimestamping(int sockfd, bool rx, bool tx)
+{
+  int flags = 0;
+  if(rx)
+    flags |= SOF_TIMESTAMPING_RX_SOFTWARE;
+  // OPT_ID numbers the sends, OPT_TSONLY keeps the error queue from holding a copy of each packet
+  if(tx)
+    flags |= SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+  if(flags)
+    flags |= SOF_TIMESTAMPING_SOFTWARE;
+  if(setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    RuntimeError(fmt::sprintf("Setting SO_TIMESTAMPING on socket: %s", strerror(errno)));
+}
+
+bool SRecvTxTimestamp(int sockfd, TxTimestamp& ts, const ErrQueueCallback& other)
+{
+  for(;;) {
+    char data[64];  // with OPT_TSONLY there is no packet, but other error queue users may send one
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(scm_timestamping)) + CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if(recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return false;
+      RuntimeError(fmt::sprintf("Reading send timestamp from error queue: %s", strerror(errno)));
+    }
+
+    bool haveTime = false, haveErr = false;
+    for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+        scm_timestamping tss;
+        memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+        ts.when = tss.ts[0];
+        haveTime = true;
+      }
+      else if((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) ||
+              (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+        sock_extended_err ee;
+        memcpy(&ee, CMSG_DATA(cmsg), sizeof(ee));
+        if(ee.ee_errno == ENOMSG && ee.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+          ts.id = ee.ee_data;
+          ts.type = ee.ee_info;
+          haveErr = true;
+          continue;
+        }
+        // not ours, but it is off the queue now, so it must go to someone who knows what it is
+        ComboAddress offender;
+        size_t offlen = cmsg->cmsg_len - CMSG_LEN(sizeof(ee));
+        if(offlen >= sizeof(sockaddr_in))
+          memcpy(&offender, CMSG_DATA(cmsg) + sizeof(ee), std::min(offlen, sizeof(sockaddr_in6)));
+        if(offender.sin4.sin_family != AF_INET && offender.sin4.sin_family != AF_INET6)
+          offender = ComboAddress();
+        if(!other)
+          RuntimeError(fmt::sprintf("Error queue message that is not a send timestamp, origin %d: %s", ee.ee_origin, strerror(ee.ee_errno)));
+        other(ee, offender);
+      }
+    }
+    if(haveTime && haveErr)
+      return true;
+  }
+}
+
+size_t SPeekDatagramSize(int sockfd, int flags)
+{
+  char dummy;
+  ssize_t res = recv(sockfd, &dummy, 1, flags | MSG_PEEK | MSG_TRUNC);
+  if(res < 0)
+    RuntimeError(fmt::sprintf("Peeking at datagram size: %s", strerror(errno)));
+  return res;
+}
+
+DatagramBatch::DatagramBatch(size_t num, size_t bufsize) : d_bufsize(bufsize), d_storage(num * bufsize), d_addrs(num), d_iov(num), d_msgs(num)
+{
+  if(!num || !bufsize)
+    RuntimeError("DatagramBatch needs room for at least one datagram of at least one byte");
+  memset(&d_msgs[0], 0, num * sizeof(mmsghdr));
+  for(size_t n = 0; n < num; ++n) {
+    d_iov[n].iov_base = buffer(n);
+    d_msgs[n].msg_hdr.msg_iov = &d_iov[n];
+    d_msgs[n].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+void DatagramBatch::setLength(size_t n, size_t len)
+{
+  if(len > d_bufsize)
+    RuntimeError(fmt::sprintf("Datagram of %d bytes does not fit in DatagramBatch buffer of %d bytes", len, d_bufsize));
+  d_msgs[n].msg_len = len;
+}
+
+void DatagramBatch::setAddress(size_t n, const ComboAddress& dest)
+{
+  d_addrs[n] = dest;
+  d_msgs[n].msg_hdr.msg_name = &d_addrs[n];
+  d_msgs[n].msg_hdr.msg_namelen = dest.getSocklen();
+}
+
+void DatagramBatch::setSize(size_t num)
+{
+  if(num > capacity())
+    RuntimeError(fmt::sprintf("DatagramBatch can hold %d datagrams, not %d", capacity(), num));
+  d_size = num;
+}
+
+bool DatagramBatch::add(std::string_view data, const ComboAddress& dest)
+{
+  if(!add(data))
+    return false;
+  setAddress(d_size - 1, dest);
+  return true;
+}
+
+bool DatagramBatch::add(std::string_view data)
+{
+  if(d_size == capacity())
+    return false;
+  setLength(d_size, data.size());
+  memcpy(buffer(d_size), data.data(), data.size());
+  d_msgs[d_size].msg_hdr.msg_name = nullptr;
+  d_msgs[d_size].msg_hdr.msg_namelen = 0;
+  ++d_size;
+  return true;
+}
+
+size_t SRecvmmsg(int sockfd, DatagramBatch& batch, int flags)
+{
+  for(size_t n = 0; n < batch.capacity(); ++n) {
+    auto& hdr = batch.d_msgs[n].msg_hdr;
+    hdr.msg_name = &batch.d_addrs[n];
+    hdr.msg_namelen = sizeof(ComboAddress);
+    batch.d_iov[n].iov_len = batch.d_bufsize;
+  }
+  batch.d_size = 0;
+  int res = recvmmsg(sockfd, &batch.d_msgs[0], batch.capacity(), flags, nullptr);
+  if(res < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    RuntimeError(fmt::sprintf("Receiving datagrams with SRecvmmsg: %s", strerror(errno)));
+  }
+  batch.d_size = res;
+  return res;
+}
+
+size_t SSendmmsg(int sockfd, DatagramBatch& batch, size_t start, int flags)
+{
+  size_t pos = start;
+  for(size_t n = start; n < batch.size(); ++n)
+    batch.d_iov[n].iov_len = batch.d_msgs[n].msg_len;
+
+  while(pos < batch.size()) {
+    int res = sendmmsg(sockfd, &batch.d_msgs[pos], batch.size() - pos, flags);
+    if(res < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      RuntimeError(fmt::sprintf("Sending datagrams with SSendmmsg: %s", strerror(errno)));
+    }
+    pos += res;
+  }
+  // sendmmsg() overwrote msg_len with the bytes sent, which for datagrams is what we had anyhow
+  return pos - start;
+}
+
+void SSendtoSegmented(int sockfd, std::string_view content, uint16_t segsize, const ComboAddress& dest, int flags)
+{
+  if(!segsize)
+    RuntimeError("SSendtoSegmented needs a segment size");
+  // the kernel takes at most 64 segments per call, and the whole buffer must fit in one IP packet
+  size_t perCall = std::min<size_t>(64, std::max<size_t>(1, 65000 / segsize)) * segsize;
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))];
+  for(size_t pos = 0; pos < content.size(); pos += perCall) {
+    iovec iov;
+    iov.iov_base = (void*)(content.data() + pos);
+    iov.iov_len = std::min(perCall, content.size() - pos);
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)&dest;
+    msg.msg_namelen = dest.getSocklen();
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(iov.iov_len > segsize) {
+      memset(control, 0, sizeof(control));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(cmsg), &segsize, sizeof(segsize));
+    }
+    if(sendmsg(sockfd, &msg, flags) < 0)
+      RuntimeError(fmt::sprintf("Sending segmented datagrams with SSendtoSegmented: %s", strerror(errno)));
+  }
+}
+
+void SetUDPSegment(int sockfd, uint16_t segsize)
+{
+  SSetsockopt(sockfd, SOL_UDP, UDP_SEGMENT, segsize);
+}
+
+void SetUDPGRO(int sockfd, bool to)
+{
+  SSetsockopt(sockfd, SOL_UDP, UDP_GRO, to);
+}
+
+CoalescedDatagrams SRecvfromGRO(int sockfd, char* buf, size_t len, ComboAddress& dest, int flags)
+{
+  iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &dest;
+  msg.msg_namelen = sizeof(dest);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t res = recvmsg(sockfd, &msg, flags);
+  if(res < 0)
+    RuntimeError(fmt::sprintf("Receiving datagrams with SRecvfromGRO: %s", strerror(errno)));
+
+  CoalescedDatagrams ret;
+  ret.data = std::string_view(buf, res);
+  for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int segsize;
+      memcpy(&segsize, CMSG_DATA(cmsg), sizeof(segsize));
+      if(segsize > 0 && segsize < res)
+        ret.segmentSize = segsize;
+    }
+  }
   return ret;
 }
 
+size_t SSendfile(int sockfd, int filefd, off_t offset, size_t len, double timeout)
+{
+  size_t sent = 0;
+  while(sent < len) {
+    off_t pos = offset + sent;
+    ssize_t res = sendfile(sockfd, filefd, &pos, len - sent);
+    if(res < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        pollfd pfd{sockfd, POLLOUT, 0};
+        int ret = poll(&pfd, 1, timeout < 0 ? -1 : (int)(timeout * 1000));
+        if(ret < 0 && errno != EINTR)
+          RuntimeError(fmt::sprintf("Waiting to send file: %s", strerror(errno)));
+        if(!ret)
+          RuntimeError("Timeout waiting to send file");
+        continue;
+      }
+      RuntimeError(fmt::sprintf("Sending file with SSendfile: %s", strerror(errno)));
+    }
+    if(!res)
+      break;
+    sent += res;
+  }
+  return sent;
+}
+
 void SGetsockname(int sock, ComboAddress& orig)
 {
   socklen_t slen=orig.getSocklen();
@@ -188,19 +703,66 @@ std::map<int, short> SPoll(const std::vector<int>&rdfds, const std::vector<int>&
   for(const auto& p : inputs) {
     pfds.push_back({p.first, p.second, 0});
   }
-  int res = poll(&pfds[0], pfds.size(), timeout*1000);
+  int res = poll(pfds.data(), pfds.size(), timeout*1000);
   if(res < 0)
     RuntimeError(fmt::sprintf("Setting up poll: %s", strerror(errno)));
   inputs.clear();
   if(res) {
     for(const auto& pfd : pfds) {
-      if((pfd.revents & pfd.events) || pfd.revents==POLLERR )
+      // revents only holds what we asked for, and POLLERR, POLLHUP or POLLNVAL, which are always of interest
+      if(pfd.revents)
         inputs[pfd.fd]=pfd.revents;
     }
   }
   return inputs;
 }
 
+void PollSet::add(int fd, short events)
+{
+  if(fd < 0)
+    RuntimeError(fmt::sprintf("Can't add file descriptor %d to PollSet", fd));
+  if(contains(fd)) {
+    d_pfds[d_positions[fd]].events = events;
+    return;
+  }
+  if((size_t)fd >= d_positions.size())
+    d_positions.resize(fd + 1, s_none);
+  d_positions[fd] = d_pfds.size();
+  d_pfds.push_back({fd, events, 0});
+}
+
+void PollSet::remove(int fd)
+{
+  if(!contains(fd))
+    return;
+  // move the last one into the hole, so removing is O(1)
+  unsigned int pos = d_positions[fd];
+  d_pfds[pos] = d_pfds.back();
+  d_positions[d_pfds[pos].fd] = pos;
+  d_pfds.pop_back();
+  d_positions[fd] = s_none;
+}
+
+size_t PollSet::poll(std::vector<Result>& results, double timeout)
+{
+  results.clear();
+  int res = ::poll(d_pfds.data(), d_pfds.size(), timeout < 0 ? -1 : (int)(timeout * 1000));
+  if(res < 0) {
+    if(errno == EINTR)
+      return 0;
+    RuntimeError(fmt::sprintf("Polling %d file descriptors: %s", d_pfds.size(), strerror(errno)));
+  }
+  for(const auto& pfd : d_pfds) {
+    if(!res)
+      break;
+    if(pfd.revents) {
+      results.push_back({pfd.fd, pfd.revents});
+      --res;
+    }
+  }
+  return results.size();
+}
+
 std::vector<ComboAddress> resolveName(const std::string& name, bool ipv4, bool ipv6)
 {
   std::vector<ComboAddress> ret;
@@ -267,12 +829,10 @@ static int msecLeft(const std::chrono::steady_clock::time_point& deadline)
 }
 
 */
-std::string SReadWithDeadline(int sock, int num, const std::chrono::steady_clock::time_point& deadline)
+void SReadWithDeadline(int sock, std::string& buffer, size_t num, const std::chrono::steady_clock::time_point& deadline)
 {
-  std::string ret;
-  char buffer[1024];
-  std::string::size_type leftToRead=num;
-  
+  size_t chunk = 0, leftToRead = num;
+
   for(; leftToRead;) {
     auto now = std::chrono::steady_clock::now();
     
@@ -287,14 +847,18 @@ std::string SReadWithDeadline(int sock, int num, const std::chrono::steady_clock
     if(res < 0)
       throw std::runtime_error("Reading with deadline: "+ std::string(strerror(errno)));
 
-    auto chunk = sizeof(buffer) < leftToRead ? sizeof(buffer) : leftToRead;
-    res = read(sock, buffer, chunk);
-    if(res < 0)
+    ssize_t got = readAppend(sock, buffer, leftToRead, chunk);
+    if(got < 0)
       throw std::runtime_error(fmt::sprintf("Read from socket: %s", strerror(errno)));
-    if(!res)
+    if(!got)
       throw std::runtime_error(fmt::sprintf("Unexpected EOF"));
-    ret.append(buffer, res);
-    leftToRead -= res;
+    leftToRead -= got;
   }
+}
+
+std::string SReadWithDeadline(int sock, int num, const std::chrono::steady_clock::time_point& deadline)
+{
+  std::string ret;
+  SReadWithDeadline(sock, ret, num, deadline);
   return ret;
 }
@@ -5,6 +5,12 @@
 #include <vector>
 #include <limits>
 #include <chrono>
+#include <functional>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <linux/errqueue.h>
 
 /** \mainpage Simple Sockets Intro
     \section intro_sec Introduction
@@ -87,6 +93,15 @@ int SBind(int sockfd, const ComboAddress& local);
 //! Accept a new connection on a socket. Error = exception.
 int SAccept(int sockfd, ComboAddress& remote);
 
+//! Accept a new connection with accept4() \p flags, like SOCK_NONBLOCK | SOCK_CLOEXEC, which saves setting them later. Error = exception.
+int SAccept(int sockfd, ComboAddress& remote, int flags);
+
+/** Accept up to \p max pending connections on non-blocking \p listenfd in one go, as happens in a connection
+    storm. Each new socket gets accept4() \p flags, and is handed to \p callback along with its peer address.
+    The callback owns the socket. Returns the number of connections accepted, stops without an exception
+    when there are no more. Other errors are exceptions. */
+size_t SAcceptMany(int listenfd, size_t max, const std::function<void(int, const ComboAddress&)>& callback, int flags=SOCK_NONBLOCK | SOCK_CLOEXEC);
+
 //! Enable listen on a socket. Error = exception.
 int SListen(int sockfd, int limit);
 
@@ -99,6 +114,15 @@ void SWrite(int sockfd, const std::string& content, std::string::size_type* wrle
 //! Attempt to write whole string to the socket, dealing with partial writes. EOF is exception.
 void SWriten(int sockfd, const std::string& content);
 
+//! Attempt to write \p iovcnt buffers to the socket with one writev() call. Returns the number of bytes written, which may be less than all of them. Error = exception.
+size_t SWritev(int sockfd, const iovec* iov, size_t iovcnt);
+
+/** Write all of \p iovcnt buffers to the socket, dealing with partial writes, so separate header, body and
+    trailer buffers do not need to be concatenated first. The buffers are not modified. Returns the number
+    of bytes written, which is less than the total only if a non-blocking socket would block. In that case,
+    call again with \p skip set to that number. EOF is exception. */
+size_t SWritenv(int sockfd, const iovec* iov, size_t iovcnt, size_t skip=0);
+
 //! Send a datagram to a destination
 void SSendto(int sockfd, const std::string& content, const ComboAddress& dest, int flags=0);
 
@@ -108,20 +132,289 @@ int SSend(int sockfd, const std::string& content, int flags=0);
 //! Receive a datagram from a destination
 std::string SRecvfrom(int sockfd, std::string::size_type limit, ComboAddress& dest, int flags=0);
 
+/** Receive a datagram into \p buf, without allocating. Returns its length. If it was longer than \p len,
+    the rest is lost, unless \p flags has MSG_TRUNC, in which case the real length is returned. Error = exception. */
+size_t SRecvfrom(int sockfd, char* buf, size_t len, ComboAddress& dest, int flags=0);
+
+//! Ask the kernel to report the local address and interface of received datagrams, for SRecvmsg. Works for IPv4, IPv6 and dual stack sockets. Error = exception.
+void SetRecvPktInfo(int sockfd);
+
+//! What SRecvmsg learned about a datagram, besides its contents
+struct DatagramInfo
+{
+  ComboAddress source;
+  //! The local address the datagram was sent to, with port 0. Needs SetRecvPktInfo(), otherwise 0.0.0.0.
+  ComboAddress destination;
+  //! The interface the datagram came in on, 0 if unknown
+  int ifindex{0};
+  //! The datagram did not fit in the buffer
+  bool truncated{false};
+  //! When the kernel received the datagram, CLOCK_REALTIME. Needs SetTimestamping() or SetTimestampNS(), otherwise 0.
+  timespec timestamp{0, 0};
+};
+
+/** Receive a datagram into \p buf, along with where it came from, and with SetRecvPktInfo(), which of our
+    addresses it was sent to. This makes it possible to bind one socket to :: or 0.0.0.0 and still reply
+    from the right address with SSendmsg. Returns the length of the datagram. Does not allocate. Error = exception.
+    Also works on stream sockets, for the receive timestamp, in which case \p info.source is not touched. */
+size_t SRecvmsg(int sockfd, char* buf, size_t len, DatagramInfo& info, int flags=0);
+
+/** Send a datagram to \p dest from local address \p source, for example the destination SRecvmsg reported.
+    A \p source of 0.0.0.0 or :: lets the kernel pick. A non-zero \p ifindex sends it out of that interface. Error = exception. */
+void SSendmsg(int sockfd, std::string_view content, const ComboAddress& dest, const ComboAddress& source, int ifindex=0, int flags=0);
+
+//! Ask the kernel to timestamp received data with SO_TIMESTAMPNS, SRecvmsg reports it in DatagramInfo::timestamp. Error = exception.
+void SetTimestampNS(int sockfd, bool to=true);
+
+/** Turn on software SO_TIMESTAMPING. With \p rx, SRecvmsg reports when data arrived in DatagramInfo::timestamp.
+    With \p tx, each send queues timestamps on the error queue, read them with SRecvTxTimestamp. Error = exception. Linux only. */
+void SetTimestamping(int sockfd, bool rx=true, bool tx=true);
+
+//! A send timestamp, from SRecvTxTimestamp
+struct TxTimestamp
+{
+  //! Counts sends from 0 for datagram sockets, for stream sockets it is the offset of the last byte of the send
+  uint32_t id;
+  //! SCM_TSTAMP_SCHED when the packet entered the queueing layer, SCM_TSTAMP_SND when it was handed to the driver
+  uint32_t type;
+  //! CLOCK_REALTIME
+  timespec when;
+};
+
+/** A message from the error queue that is not a send timestamp, for example a MSG_ZEROCOPY completion or an ICMP
+    error from IP_RECVERR. \p offender is where an ICMP error came from, 0.0.0.0 if there is none. */
+typedef std::function<void(const sock_extended_err& err, const ComboAddress& offender)> ErrQueueCallback;
+
+/** Read one send timestamp from the error queue of \p sockfd, see SetTimestamping. Returns false if there is none yet,
+    never blocks. The error queue can't be peeked at, so other messages read on the way are passed to \p other,
+    for example to ZeroCopySender::completion(). Without \p other, they are an exception. Error = exception. */
+bool SRecvTxTimestamp(int sockfd, TxTimestamp& ts, const ErrQueueCallback& other=nullptr);
+
+/** Returns the length of the next datagram on \p sockfd without receiving it, so a buffer of exactly
+    the right size can be passed to SRecvfrom. Waits for a datagram, unless the socket is non-blocking
+    or \p flags has MSG_DONTWAIT. Error = exception. Linux only. */
+size_t SPeekDatagramSize(int sockfd, int flags=0);
+
+/** A reusable set of datagram buffers and addresses, for receiving or sending many datagrams
+    with one system call using SRecvmmsg() and SSendmmsg(). All memory is allocated up front,
+    so a batch can be reused for millions of packets without allocating.
+\code{.cpp}
+    DatagramBatch batch(64, 1500);
+    for(;;) {
+      SRecvmmsg(s, batch);
+      for(size_t n = 0; n < batch.size(); ++n)
+        process(batch.data(n), batch.address(n));
+      SSendmmsg(s, batch);  // echo everything back to where it came from
+    }
+\endcode
+*/
+class DatagramBatch
+{
+public:
+  //! Room for \p num datagrams of at most \p bufsize bytes each
+  DatagramBatch(size_t num, size_t bufsize);
+
+  DatagramBatch(const DatagramBatch&) = delete;
+  DatagramBatch& operator=(const DatagramBatch&) = delete;
+
+  //! Maximum number of datagrams
+  size_t capacity() const
+  {
+    return d_msgs.size();
+  }
+  //! Number of datagrams currently held
+  size_t size() const
+  {
+    return d_size;
+  }
+  size_t bufferSize() const
+  {
+    return d_bufsize;
+  }
+  void clear()
+  {
+    d_size = 0;
+  }
+
+  //! Queues a copy of \p data for sending to \p dest, returns false if the batch is full. Throws if \p data does not fit.
+  bool add(std::string_view data, const ComboAddress& dest);
+  //! Queues a copy of \p data for sending on a connected socket, returns false if the batch is full
+  bool add(std::string_view data);
+
+  //! Datagram \p n, as received or queued
+  std::string_view data(size_t n) const
+  {
+    return std::string_view(buffer(n), d_msgs[n].msg_len);
+  }
+  //! Where datagram \p n came from, or where it will be sent
+  const ComboAddress& address(size_t n) const
+  {
+    return d_addrs[n];
+  }
+  //! True if datagram \p n was larger than bufferSize(), and got cut off
+  bool truncated(size_t n) const
+  {
+    return d_msgs[n].msg_hdr.msg_flags & MSG_TRUNC;
+  }
+
+  /** For filling in datagram \p n in place: a buffer of bufferSize() bytes. Call setLength() after,
+      and setAddress() if the socket is not connected. */
+  char* buffer(size_t n)
+  {
+    return &d_storage[n * d_bufsize];
+  }
+  const char* buffer(size_t n) const
+  {
+    return &d_storage[n * d_bufsize];
+  }
+  void setLength(size_t n, size_t len);
+  void setAddress(size_t n, const ComboAddress& dest);
+  //! Sets the number of datagrams for sending, after filling them in with buffer()
+  void setSize(size_t num);
+
+private:
+  friend size_t SRecvmmsg(int sockfd, DatagramBatch& batch, int flags);
+  friend size_t SSendmmsg(int sockfd, DatagramBatch& batch, size_t start, int flags);
+
+  size_t d_bufsize;
+  size_t d_size{0};
+  std::vector<char> d_storage;
+  std::vector<ComboAddress> d_addrs;
+  std::vector<iovec> d_iov;
+  std::vector<mmsghdr> d_msgs;
+};
+
+/** Receive up to batch.capacity() datagrams with one recvmmsg() call. Replaces what was in \p batch,
+    and returns the number of datagrams received. Blocks until there is at least one datagram,
+    unless the socket is non-blocking or \p flags has MSG_DONTWAIT, in which case 0 is returned
+    if there is nothing to read. Other errors are exceptions. Linux only. */
+size_t SRecvmmsg(int sockfd, DatagramBatch& batch, int flags=0);
+
+/** Send the datagrams in \p batch from position \p start onwards, with as few sendmmsg() calls
+    as possible. Returns the number of datagrams sent, which is less than batch.size()-start only
+    if a non-blocking socket would block. Errors are exceptions. Linux only. */
+size_t SSendmmsg(int sockfd, DatagramBatch& batch, size_t start=0, int flags=0);
+
+/** Send \p content to \p dest as datagrams of \p segsize bytes each (the last one may be shorter),
+    using UDP segmentation offload (GSO). The kernel cuts up the buffer, so this costs one system
+    call per 64 datagrams instead of one per datagram. Errors are exceptions, EIO means the
+    outgoing interface can't do segmentation. Linux 4.18 and up. */
+void SSendtoSegmented(int sockfd, std::string_view content, uint16_t segsize, const ComboAddress& dest, int flags=0);
+
+//! Turn UDP GSO on for all sends on a socket, 0 turns it off. Error = exception.
+void SetUDPSegment(int sockfd, uint16_t segsize);
+
+//! Allow the kernel to coalesce received datagrams from the same source (GRO), use with SRecvfromGRO. Error = exception.
+void SetUDPGRO(int sockfd, bool to=true);
+
+/** A received buffer holding one or more coalesced datagrams of segmentSize bytes each, except
+    for the last one which may be shorter. Points into the caller's buffer. */
+struct CoalescedDatagrams
+{
+  std::string_view data;
+  uint16_t segmentSize{0};  //!< 0 if this is a single datagram
+
+  size_t count() const
+  {
+    if(!segmentSize)
+      return 1;
+    return (data.size() + segmentSize - 1) / segmentSize;
+  }
+  //! Datagram \p n
+  std::string_view operator[](size_t n) const
+  {
+    if(!segmentSize)
+      return data;
+    return data.substr(n * segmentSize, segmentSize);
+  }
+};
+
+/** Receive a datagram, or several coalesced ones from the same source if SetUDPGRO() was called,
+    into \p buf. Use a buffer of 64KB to get the most out of this. Error = exception. Linux 5.0 and up. */
+CoalescedDatagrams SRecvfromGRO(int sockfd, char* buf, size_t len, ComboAddress& dest, int flags=0);
+
 
 //! Retrieve sockname
 void SGetsockname(int sockfd, ComboAddress& dest);
 
+/** Send \p len bytes from file \p filefd, starting at \p offset, to socket \p sockfd with sendfile(), so the
+    data never passes through user space. Deals with partial transfers. On a non-blocking socket, waits up to
+    \p timeout seconds (negative is infinite) for room each time the socket is full.
+    Returns the number of bytes sent, which is less than \p len only if the file ended. Timeout is exception. */
+size_t SSendfile(int sockfd, int filefd, off_t offset, size_t len, double timeout=-1);
+
 //! Read at most \p bytes bytes from fd \p sockfd. Will stop reading after EOF, which is not an exception.
 std::string SRead(int sockfd, std::string::size_type limit = std::numeric_limits<std::string::size_type>::max());
 
+//! Like SRead, but appends to \p buffer, so its memory can be reused across calls. Returns the number of bytes appended.
+size_t SRead(int sockfd, std::string& buffer, std::string::size_type limit = std::numeric_limits<std::string::size_type>::max());
+
 //! Set a socket to (non) blocking mode. Error = exception.
 void SetNonBlocking(int sockfd, bool to=true);
 
-
+/** Wait up to \p timeout seconds (negative is infinite) for \p rdfds to become readable or \p wrfds writable.
+    Returns the fds that have events, with their revents, which includes POLLERR and POLLHUP. Error = exception.
+    Builds its poll set anew for each call, for repeated polling of the same fds, PollSet is cheaper. */
 std::map<int,short> SPoll(const std::vector<int>&rdfds, const std::vector<int>&wrfds, double timeout);
 
+/** A set of file descriptors to poll(), kept across calls, so polling the same fds over and over does
+    not allocate. For thousands of fds, EventLoop is faster. This class has state: the fds and their events.
+\code{.cpp}
+    PollSet ps;
+    ps.add(sock1, POLLIN);
+    ps.add(sock2, POLLIN | POLLOUT);
+    std::vector<PollSet::Result> results;
+    for(;;) {
+      ps.poll(results, 1.0);
+      for(const auto& r : results) {
+        if(r.revents & (POLLERR | POLLHUP))
+          ...
+      }
+    }
+\endcode
+*/
+class PollSet
+{
+public:
+  struct Result
+  {
+    int fd;
+    short revents;  //!< the events that happened, POLLERR, POLLHUP and POLLNVAL are reported even if not asked for
+  };
+
+  //! Watch \p fd for \p events, like POLLIN or POLLOUT, replacing the events it was watched for before, if any
+  void add(int fd, short events);
+
+  //! Stop watching \p fd, does nothing if it was not being watched
+  void remove(int fd);
+
+  //! Is \p fd being watched?
+  bool contains(int fd) const
+  {
+    return fd >= 0 && (size_t)fd < d_positions.size() && d_positions[fd] != s_none;
+  }
+
+  //! Number of file descriptors being watched
+  size_t size() const
+  {
+    return d_pfds.size();
+  }
+
+  /** Wait up to \p timeout seconds (negative is infinite) for events. Replaces the contents of \p results with
+      the fds that have events, and returns how many there are. A signal is 0 results. Error = exception. */
+  size_t poll(std::vector<Result>& results, double timeout);
+
+private:
+  static constexpr unsigned int s_none = 0xffffffff;
+  std::vector<pollfd> d_pfds;
+  std::vector<unsigned int> d_positions;  // index in d_pfds per fd, or s_none
+};
+
 //! Use system facilities to resolve a name into addresses. If no address found, returns empty vector
 std::vector<ComboAddress> resolveName(const std::string& name, bool ipv4=true, bool ipv6=true);
 
+//! Read exactly \p num bytes before \p deadline. Timeout and EOF are exceptions.
 std::string SReadWithDeadline(int sock, int num, const std::chrono::steady_clock::time_point& deadline);
+
+//! Like SReadWithDeadline, but appends to \p buffer, so its memory can be reused across calls
+void SReadWithDeadline(int sock, std::string& buffer, size_t num, const std::chrono::steady_clock::time_point& deadline);
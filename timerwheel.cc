@@ -0,0 +1,184 @@
+#include "timerwheel.hh"
+#include <stdexcept>
+#include <algorithm>
+
+TimerWheel::TimerWheel(std::chrono::steady_clock::duration resolution) : d_lists(s_levels * s_slots + 1, s_none), d_resolution(resolution), d_start(std::chrono::steady_clock::now())
+{
+  if(resolution.count() <= 0)
+    throw std::runtime_error("TimerWheel resolution must be positive");
+}
+
+//! The last tick that started at or before \p tp
+uint64_t TimerWheel::toTick(const time_point& tp) const
+{
+  if(tp <= d_start)
+    return 0;
+  return (tp - d_start) / d_resolution;
+}
+
+void TimerWheel::link(uint32_t t, uint32_t list)
+{
+  Timer& timer = d_timers[t];
+  timer.list = list;
+  ++d_counts[list / s_slots];
+  timer.prev = s_none;
+  timer.next = d_lists[list];
+  if(timer.next != s_none)
+    d_timers[timer.next].prev = t;
+  d_lists[list] = t;
+}
+
+void TimerWheel::unlink(uint32_t t)
+{
+  Timer& timer = d_timers[t];
+  --d_counts[timer.list / s_slots];
+  if(timer.prev != s_none)
+    d_timers[timer.prev].next = timer.next;
+  else
+    d_lists[timer.list] = timer.next;
+  if(timer.next != s_none)
+    d_timers[timer.next].prev = timer.prev;
+}
+
+//! Puts timer \p t in the slot where it will be found in time, counting from the next tick to be expired
+void TimerWheel::place(uint32_t t)
+{
+  uint64_t next = d_now + 1;
+  uint64_t expiry = std::max(d_timers[t].expiry, next);
+  uint64_t delta = expiry - next;
+  unsigned int level = 0;
+  while(level < s_levels - 1 && delta >= (1ULL << (s_bits * (level + 1))))
+    ++level;
+  if(delta >= (1ULL << (s_bits * s_levels)))
+    expiry = next + (1ULL << (s_bits * s_levels)) - 1;  // too far away, come back when we're closer
+  link(t, level * s_slots + ((expiry >> (s_bits * level)) & (s_slots - 1)));
+}
+
+//! Moves the timers in the current slot of \p level down to lower levels, now that they are closer
+void TimerWheel::cascade(unsigned int level)
+{
+  uint32_t list = level * s_slots + (((d_now + 1) >> (s_bits * level)) & (s_slots - 1));
+  uint32_t t = d_lists[list];
+  d_lists[list] = s_none;
+  while(t != s_none) {
+    --d_counts[level];
+    uint32_t next = d_timers[t].next;
+    place(t);
+    t = next;
+  }
+}
+
+TimerWheel::TimerId TimerWheel::arm(const time_point& deadline, Callback callback)
+{
+  uint32_t t;
+  if(d_free.empty()) {
+    t = d_timers.size();
+    d_timers.emplace_back();
+    d_timers[t].generation = 1;
+  }
+  else {
+    t = d_free.back();
+    d_free.pop_back();
+  }
+  Timer& timer = d_timers[t];
+  timer.callback = std::move(callback);
+  // rounded up, so it never fires early
+  timer.expiry = deadline <= d_start ? 0 : (deadline - d_start + d_resolution - std::chrono::steady_clock::duration(1)) / d_resolution;
+  place(t);
+  ++d_size;
+  return ((uint64_t)timer.generation << 32) | t;
+}
+
+bool TimerWheel::cancel(TimerId id)
+{
+  uint32_t t = id;
+  if(t >= d_timers.size() || d_timers[t].generation != (id >> 32) || d_timers[t].list == s_none)
+    return false;
+  unlink(t);
+  Timer& timer = d_timers[t];
+  timer.callback = nullptr;
+  timer.list = s_none;
+  if(!++timer.generation)
+    timer.generation = 1;
+  d_free.push_back(t);
+  --d_size;
+  return true;
+}
+
+//! Fires the timers on the s_expiring list
+size_t TimerWheel::fireExpiring()
+{
+  size_t called = 0;
+  uint32_t t;
+  while((t = d_lists[s_expiring]) != s_none) {
+    Callback callback = std::move(d_timers[t].callback);
+    cancel(((uint64_t)d_timers[t].generation << 32) | t);
+    callback();
+    ++called;
+  }
+  return called;
+}
+
+size_t TimerWheel::expire(const time_point& now)
+{
+  uint64_t target = toTick(now);
+  // left over if a callback threw last time
+  size_t called = fireExpiring();
+  while(d_now < target) {
+    // nothing happens until the lowest wheel with timers in it turns to its next slot, so skip ahead to there
+    unsigned int level = 0;
+    while(level < s_levels && !d_counts[level])
+      ++level;
+    if(level == s_levels) {
+      d_now = target;
+      break;
+    }
+    if(level > 0) {
+      uint64_t turn = (d_now | ((1ULL << (s_bits * level)) - 1)) + 1;
+      d_now = std::min(target, turn - 1);
+      if(d_now == target)
+        break;
+    }
+
+    uint64_t tick = d_now + 1;
+    for(unsigned int level = s_levels - 1; level > 0; --level)
+      if(!(tick & ((1ULL << (s_bits * level)) - 1)))
+        cascade(level);
+    d_now = tick;
+
+    // callbacks may cancel timers that are due in this same tick, so they stay on a list until they fire
+    uint32_t t = d_lists[tick & (s_slots - 1)];
+    d_lists[tick & (s_slots - 1)] = s_none;
+    d_lists[s_expiring] = t;
+    for(; t != s_none; t = d_timers[t].next) {
+      d_timers[t].list = s_expiring;
+      --d_counts[0];
+      ++d_counts[s_levels];
+    }
+    called += fireExpiring();
+  }
+  return called;
+}
+
+double TimerWheel::nextTimeout(const time_point& now) const
+{
+  if(!d_size)
+    return -1;
+  unsigned int level = 0;
+  while(level < s_levels && !d_counts[level])
+    ++level;
+  if(level == s_levels)
+    return 0;  // only timers a callback threw in front of
+
+  // the first tick with something in the lowest wheel, but no later than the next cascade, which might bring timers down
+  uint64_t tick = d_now + 1;
+  if(level > 0)
+    tick = (d_now | ((1ULL << (s_bits * level)) - 1)) + 1;
+  else
+    for(uint64_t cascade = (d_now | (s_slots - 1)) + 1; tick < cascade && d_lists[tick & (s_slots - 1)] == s_none; ++tick)
+      ;
+  auto when = d_start + tick * d_resolution;
+  if(when <= now)
+    return 0;
+  return std::chrono::duration<double>(when - now).count();
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+/** \file timerwheel.hh
+    \brief Hierarchical timer wheel, for very many timeouts that are mostly cancelled before they expire
+*/
+
+/** TimerWheel keeps timers in four wheels of 256 slots, the first has one slot per tick, the next one
+    slot per 256 ticks and so on. Arming and cancelling a timer is O(1), as is expiring one: timers
+    move down a wheel at most three times as their deadline gets closer, and then expire together with
+    the others in their slot.
+
+    Deadlines are rounded up to whole ticks of \p resolution, so timers never fire early, but can fire up
+    to one tick late, or more if expire() is called less often. All memory for timers is reused, so once
+    the wheel has held as many timers as it ever will, arming does not allocate, except for the callback.
+\code{.cpp}
+    TimerWheel tw;
+    auto id = tw.arm(std::chrono::steady_clock::now() + std::chrono::seconds(2), [] { ... });
+    ...
+    tw.cancel(id);  // got an answer in time
+    ...
+    tw.expire();    // calls callbacks of timers that expired, do this in your event loop
+\endcode
+    EventLoop has a TimerWheel built in. Not thread safe.
+*/
+class TimerWheel
+{
+public:
+  typedef std::function<void()> Callback;
+  typedef std::chrono::steady_clock::time_point time_point;
+  //! Identifies an armed timer, 0 is never used, so it can mean 'no timer'
+  typedef uint64_t TimerId;
+
+  explicit TimerWheel(std::chrono::steady_clock::duration resolution=std::chrono::milliseconds(1));
+
+  //! Calls \p callback from expire() once \p deadline has passed
+  TimerId arm(const time_point& deadline, Callback callback);
+
+  //! Calls \p callback from expire() after \p seconds
+  TimerId arm(double seconds, Callback callback)
+  {
+    return arm(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds)), std::move(callback));
+  }
+
+  //! Returns false if the timer already expired or was cancelled, which is fine
+  bool cancel(TimerId id);
+
+  //! Calls the callbacks of all timers with a deadline before \p now, which may arm and cancel timers. Returns how many.
+  size_t expire(const time_point& now=std::chrono::steady_clock::now());
+
+  /** How long until expire() could have something to do, in seconds, for use as a timeout for poll() or
+      epoll_wait(). Can be too early, but never too late. Negative if no timers are armed. */
+  double nextTimeout(const time_point& now=std::chrono::steady_clock::now()) const;
+
+  //! Number of armed timers
+  size_t size() const
+  {
+    return d_size;
+  }
+
+private:
+  static constexpr uint32_t s_none = 0xffffffff;
+  static constexpr unsigned int s_levels = 4;
+  static constexpr unsigned int s_bits = 8;
+  static constexpr unsigned int s_slots = 1 << s_bits;
+  static constexpr uint32_t s_expiring = s_levels * s_slots;  // list of timers being expired right now
+
+  struct Timer
+  {
+    Callback callback;
+    uint64_t expiry;       // in ticks
+    uint32_t list{s_none}; // slot it is in, s_none when free
+    uint32_t prev, next;
+    uint32_t generation{0};
+  };
+
+  uint64_t toTick(const time_point& tp) const;
+  void link(uint32_t t, uint32_t list);
+  void unlink(uint32_t t);
+  void place(uint32_t t);
+  void cascade(unsigned int level);
+  size_t fireExpiring();
+
+  std::vector<Timer> d_timers;
+  std::vector<uint32_t> d_free;
+  std::vector<uint32_t> d_lists;  // first timer per slot, per level, plus s_expiring
+  size_t d_counts[s_levels + 1]{}; // timers per level, and on s_expiring
+  std::chrono::steady_clock::duration d_resolution;
+  time_point d_start;
+  uint64_t d_now{0};              // all ticks up to and including this one have been expired
+  size_t d_size{0};
+};